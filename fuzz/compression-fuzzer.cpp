@@ -0,0 +1,27 @@
+#include <compression.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <message.h>
+#include <vector>
+
+// Compares Compression::compress with the frozen reference encoder on any payload a client could send
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, std::size_t size) {
+
+	// Anything longer is rejected by check_header before it reaches the encoder
+	if (size > Message_Constants::PAYLOAD_SIZE) {
+		return 0;
+	}
+
+	std::vector<char> input(data, data + size);
+
+	auto result = Compression::compress(input.data(), input.size());
+	auto expected = Compression::Reference::compress(input);
+
+	if (result != expected) {
+		fprintf(stderr, "Compression differs from the reference for a %zu byte input\n", size);
+		abort();
+	}
+
+	return 0;
+}
@@ -0,0 +1,173 @@
+#include <algorithm>
+#include <compression.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <message.h>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+// Checks Compression::compress against the frozen reference encoder, first on
+// inputs chosen to hit the encoder's edge cases and then on a fixed-seed random
+// stream, so a failure reproduces on every run. Exits non-zero on the first
+// input where the two differ.
+
+static constexpr uint32_t SEED = 0x53545259;
+static constexpr std::size_t DEFAULT_RANDOM_CASES = 20000;
+
+// Run lengths where the count changes width or stops being written out literally
+static constexpr std::size_t RUN_LENGTHS[] = {1, 2, 3, 9, 10, 11, 99, 100, 101, 999, 1000, 1001, 4095, 4096};
+
+// Bytes islower rejects, including ones that are negative as a char
+static constexpr char NON_LOWERCASE[] = {'A', 'Z', '0', '9', ' ', '\0', '\n', '\x7f', '\x80', '\xff', '`', '{'};
+
+struct Case {
+	std::string name;
+	std::vector<char> input;
+};
+
+std::vector<char> run(char c, std::size_t length) {
+	return std::vector<char>(length, c);
+}
+
+std::vector<char> concat(std::vector<char> a, const std::vector<char>& b) {
+	a.insert(a.end(), b.begin(), b.end());
+	return a;
+}
+
+std::vector<Case> adversarial_corpus() {
+
+	std::vector<Case> corpus;
+	corpus.push_back({"empty", {}});
+
+	for (char c = 'a'; c <= 'z'; c++) {
+		corpus.push_back({std::string("single ") + c, {c}});
+	}
+
+	for (std::size_t length: RUN_LENGTHS) {
+		corpus.push_back({"run of " + std::to_string(length), run('a', length)});
+		corpus.push_back({"run of " + std::to_string(length) + " after one", concat({'z'}, run('a', length))});
+		corpus.push_back({"run of " + std::to_string(length) + " before one", concat(run('a', length), {'z'})});
+	}
+
+	// Neighbouring runs that both sit on a width boundary, kept within one payload
+	for (std::size_t first: RUN_LENGTHS) {
+		for (std::size_t second: RUN_LENGTHS) {
+			if (first + second <= Message_Constants::PAYLOAD_SIZE) {
+				corpus.push_back({"runs of " + std::to_string(first) + " and " + std::to_string(second),
+								  concat(run('q', first), run('r', second))});
+			}
+		}
+	}
+
+	std::vector<char> alternating;
+	std::vector<char> pairs;
+	std::vector<char> alphabet;
+	for (std::size_t i = 0; i < Message_Constants::PAYLOAD_SIZE; i++) {
+		alternating.push_back(i % 2 == 0 ? 'a' : 'b');
+		pairs.push_back((i / 2) % 2 == 0 ? 'a' : 'b');
+		alphabet.push_back(static_cast<char>('a' + i % 26));
+	}
+	corpus.push_back({"alternating 4 KiB", alternating});
+	corpus.push_back({"pairs 4 KiB", pairs});
+	corpus.push_back({"alphabet 4 KiB", alphabet});
+
+	for (char c: NON_LOWERCASE) {
+		std::string byte = std::to_string(static_cast<uint8_t>(c));
+		corpus.push_back({"only byte " + byte, {c}});
+		corpus.push_back({"byte " + byte + " first", concat({c}, run('a', 100))});
+		corpus.push_back({"byte " + byte + " last in 4 KiB", concat(run('a', Message_Constants::PAYLOAD_SIZE - 1), {c})});
+		corpus.push_back({"byte " + byte + " inside a run", concat(concat(run('a', 50), {c}), run('a', 50))});
+	}
+
+	return corpus;
+}
+
+// Mostly lowercase with run lengths spread across every width the count can take
+std::vector<char> random_input(std::mt19937* rng) {
+
+	std::uniform_int_distribution<int> mode(0, 9);
+	std::uniform_int_distribution<std::size_t> size(0, Message_Constants::PAYLOAD_SIZE);
+	std::uniform_int_distribution<int> byte(0, 255);
+
+	std::size_t length = size(*rng);
+	std::vector<char> input;
+	input.reserve(length);
+
+	int chosen = mode(*rng);
+	if (chosen == 0) {
+		// Arbitrary bytes, almost always rejected
+		while (input.size() < length) {
+			input.push_back(static_cast<char>(byte(*rng)));
+		}
+		return input;
+	}
+
+	// A small alphabet makes equal neighbouring runs likely
+	std::uniform_int_distribution<int> letter(0, chosen < 5 ? 1 : 25);
+	std::geometric_distribution<std::size_t> run_length(chosen % 2 == 0 ? 0.5 : 0.01);
+	while (input.size() < length) {
+		char c = static_cast<char>('a' + letter(*rng));
+		std::size_t n = std::min(length - input.size(), run_length(*rng) + 1);
+		input.insert(input.end(), n, c);
+	}
+
+	// Sometimes one byte the encoder has to reject
+	if (chosen == 9 && !input.empty()) {
+		std::uniform_int_distribution<std::size_t> position(0, input.size() - 1);
+		std::uniform_int_distribution<std::size_t> bad(0, sizeof(NON_LOWERCASE) - 1);
+		input[position(*rng)] = NON_LOWERCASE[bad(*rng)];
+	}
+
+	return input;
+}
+
+// Returns 0 if compress agrees with the reference on input
+bool check(const std::string& name, const std::vector<char>& input) {
+
+	auto result = Compression::compress(input.data(), input.size());
+	auto expected = Compression::Reference::compress(input);
+
+	if (result == expected) {
+		return false;
+	}
+
+	fprintf(stderr, "Mismatch on %s (%zu bytes)\n", name.c_str(), input.size());
+	fprintf(stderr, "Input:");
+	for (std::size_t i = 0; i < std::min<std::size_t>(input.size(), 64); i++) {
+		fprintf(stderr, " %02x", static_cast<uint8_t>(input[i]));
+	}
+	fprintf(stderr, input.size() > 64 ? " ...\n" : "\n");
+
+	auto describe = [](const std::optional<std::vector<char>>& output) {
+		return output.has_value() ? std::to_string(output->size()) + " bytes" : std::string("rejected");
+	};
+	fprintf(stderr, "compress: %s, reference: %s\n", describe(result).c_str(), describe(expected).c_str());
+
+	return true;
+}
+
+int main(int argc, char** argv) {
+
+	std::size_t num_random = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : DEFAULT_RANDOM_CASES;
+
+	std::vector<Case> corpus = adversarial_corpus();
+	for (const Case& c: corpus) {
+		if (check(c.name, c.input)) {
+			return 1;
+		}
+	}
+
+	std::mt19937 rng(SEED);
+	for (std::size_t i = 0; i < num_random; i++) {
+		if (check("random case " + std::to_string(i), random_input(&rng))) {
+			return 1;
+		}
+	}
+
+	printf("%zu adversarial and %zu random inputs match the reference\n", corpus.size(), num_random);
+
+	return 0;
+}
@@ -0,0 +1,71 @@
+#include <compression.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <message.h>
+#include <optional>
+#include <payload-pool.h>
+#include <request-code.h>
+#include <vector>
+#include <wire-format.h>
+
+// Treats arbitrary bytes as the frame a client sends and reads it the way both
+// transports do: a listener decodes the header and receives the payload into a
+// pooled block, a shared-memory session parses it in place in a ring slot.
+// Whatever is accepted is then compressed like a worker would, so under
+// AddressSanitizer an accepted length that does not fit where the payload goes
+// is a heap overflow rather than a silent read of the neighbouring slot.
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, std::size_t size) {
+
+	if (size < Message_Constants::HEADER_SIZE || size > Message_Constants::MESSAGE_SIZE) {
+		return 0;
+	}
+
+	// Exactly the size of a slot's frame, zero past the input like a freshly mapped ring
+	auto slot = std::make_unique<uint8_t[]>(Message_Constants::MESSAGE_SIZE);
+	memcpy(slot.get(), data, size);
+	const char* sent_payload = reinterpret_cast<const char*>(slot.get()) + Message_Constants::HEADER_SIZE;
+
+	Header h = Wire_Format::decode_header(slot.get());
+
+	// Decoding loses nothing, so the header encodes back to the bytes it came from
+	Wire_Format::Header_Layout::Bytes encoded = Wire_Format::encode_header(h);
+	if (memcmp(encoded.data(), slot.get(), encoded.size()) != 0) {
+		fprintf(stderr, "Header did not survive an encode/decode round trip\n");
+		abort();
+	}
+
+	// Socket transport, as handle_client and create_message
+	Status_Code status = check_header(h);
+	std::optional<std::vector<char>> socket_response;
+	if (status == Status_Code::OK && h.payload_length > 0) {
+		auto block = std::make_unique<Payload_Block>();
+		memcpy(block->data(), sent_payload, h.payload_length);
+		if (h.code == static_cast<uint16_t>(Request_Code::COMPRESS)) {
+			socket_response = Compression::compress(block->data(), h.payload_length);
+		}
+	}
+
+	// Shared-memory transport, as handle_doorbell
+	Frame frame = parse_frame(slot.get());
+	if (frame.status != status || frame.size > Message_Constants::MESSAGE_SIZE) {
+		fprintf(stderr, "parse_frame returned status %u and size %zu where check_header returned %u\n",
+				static_cast<unsigned>(frame.status), frame.size, static_cast<unsigned>(status));
+		abort();
+	}
+
+	std::optional<std::vector<char>> shm_response;
+	if (frame.status == Status_Code::OK && frame.header.code == static_cast<uint16_t>(Request_Code::COMPRESS) &&
+		frame.header.payload_length > 0) {
+		shm_response = Compression::compress(sent_payload, frame.header.payload_length);
+	}
+
+	if (socket_response != shm_response) {
+		fprintf(stderr, "Socket and shared-memory transports answered a %zu byte frame differently\n", size);
+		abort();
+	}
+
+	return 0;
+}
@@ -0,0 +1,74 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <dirent.h>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, std::size_t size);
+
+// Adds path to files, or every file directly inside it if it is a directory like a libFuzzer corpus
+bool collect(const std::string& path, std::vector<std::string>* files) {
+
+	struct stat info;
+	if (stat(path.c_str(), &info) == -1) {
+		fprintf(stderr, "Could not open %s\n", path.c_str());
+		return true;
+	}
+
+	if (!S_ISDIR(info.st_mode)) {
+		files->push_back(path);
+		return false;
+	}
+
+	DIR* dir = opendir(path.c_str());
+	if (dir == nullptr) {
+		fprintf(stderr, "Could not open %s\n", path.c_str());
+		return true;
+	}
+
+	std::vector<std::string> entries;
+	while (struct dirent* entry = readdir(dir)) {
+		std::string name = entry->d_name;
+		if (name != "." && name != "..") {
+			entries.push_back(path + "/" + name);
+		}
+	}
+	closedir(dir);
+
+	// Replay in the same order on every run
+	std::sort(entries.begin(), entries.end());
+	files->insert(files->end(), entries.begin(), entries.end());
+
+	return false;
+}
+
+// Stands in for libFuzzer's main when the compiler has none, runs the target once on each file given
+int main(int argc, char** argv) {
+
+	std::vector<std::string> files;
+	for (int i = 1; i < argc; i++) {
+		if (collect(argv[i], &files)) {
+			return 1;
+		}
+	}
+
+	for (const std::string& path: files) {
+
+		std::ifstream file(path, std::ios::binary);
+		if (!file) {
+			fprintf(stderr, "Could not open %s\n", path.c_str());
+			return 1;
+		}
+
+		std::vector<uint8_t> input((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		LLVMFuzzerTestOneInput(input.data(), input.size());
+	}
+
+	printf("Replayed %zu inputs\n", files.size());
+
+	return 0;
+}
@@ -0,0 +1,5 @@
+# Creates a self-signed certificate for testing TLS over loopback
+mkdir -p ./certs
+openssl req -x509 -newkey rsa:2048 -nodes -days 365 \
+    -subj "/CN=localhost" -addext "subjectAltName=DNS:localhost,IP:127.0.0.1" \
+    -keyout ./certs/key.pem -out ./certs/cert.pem
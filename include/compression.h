@@ -1,6 +1,7 @@
 #ifndef COMPRESSION_H
 #define COMPRESSION_H
 
+#include <array>
 #include <cstdint>
 #include <cmath>
 #include <message.h>
@@ -8,13 +9,24 @@
 #include <vector>
 namespace Compression {
 
-    std::optional<std::vector<char>> compress(const std::vector<char>& input);
+    std::optional<std::vector<char>> compress(const char* input, std::size_t size);
+
+    inline std::optional<std::vector<char>> compress(const std::vector<char>& input) {
+        return compress(input.data(), input.size());
+    }
 
     static constexpr std::size_t COUNT_MAX_DIGITS = 5;
     static constexpr std::size_t COUNT_BUFFER_SIZE = COUNT_MAX_DIGITS + 1;
 
     using Buffer = std::array<char, COUNT_BUFFER_SIZE>;    
 
+    namespace Reference {
+
+        // Original scalar encoder, the expected output for any faster implementation of compress
+        std::optional<std::vector<char>> compress(const std::vector<char>& input);
+
+    } // namespace Reference
+
 } // namespace Compression
 
 #endif // COMPRESSION_H
\ No newline at end of file
@@ -3,7 +3,6 @@
 
 #include <algorithm>
 #include <cstdint>
-#include <netinet/in.h>
 #include <status-code.h>
 #include <vector>
 
@@ -15,18 +14,6 @@ namespace Message_Constants {
 } // namespace Message_Constants
 struct Header {
 
-    void set_net_order() {
-        this->magic_number = htonl(this->magic_number);
-        this->payload_length = htons(this->payload_length);
-        this->code = htons(this->code);
-    }
-
-    void set_host_order() {
-        this->magic_number = ntohl(this->magic_number);
-        this->payload_length = ntohs(this->payload_length);
-        this->code = ntohs(this->code);
-    }
-
     uint32_t magic_number = Message_Constants::MAGIC_NUMBER;
     uint16_t payload_length = 0;
     uint16_t code = static_cast<uint16_t>(Status_Code::OK);
@@ -40,12 +27,21 @@ struct Message {
     std::vector<char> payload;
 };
 
-struct Network_Order_Message {
+// Returns OK if a request with header h can be serviced, otherwise the status to reply with
+Status_Code check_header(const Header& h);
 
-    explicit Network_Order_Message(Header h): header(h) {} 
+// A request read in place from a MESSAGE_SIZE buffer, the way shared-memory ring slots hold them
+struct Frame {
 
     Header header;
-    std::vector<char> payload;
+    // OK if the request can be serviced, otherwise the status to reply with
+    Status_Code status = Status_Code::OK;
+    // Bytes of the buffer the request claims, never more than MESSAGE_SIZE
+    std::size_t size = 0;
 };
 
+// Parses the frame at the start of buffer. When status is OK the payload is the header.payload_length
+// bytes that follow the header, all within the buffer
+Frame parse_frame(const uint8_t* buffer);
+
 #endif // MESSAGE_H
\ No newline at end of file
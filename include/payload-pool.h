@@ -0,0 +1,108 @@
+#ifndef PAYLOAD_POOL_H
+#define PAYLOAD_POOL_H
+
+#include <array>
+#include <memory>
+#include <message.h>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+using Payload_Block = std::array<char, Message_Constants::PAYLOAD_SIZE>;
+
+class Payload_Pool;
+
+// Owns a pooled block holding a received payload. Listeners recv straight into
+// it and hand it to a worker inside the Job; the block goes back to its pool
+// when the Job is destroyed after the response is sent. It can also refer to a
+// payload that already sits in shared memory, in which case nothing is pooled.
+class Pooled_Payload {
+
+    public:
+
+        Pooled_Payload() = default;
+
+        Pooled_Payload(Payload_Pool* pool, std::unique_ptr<Payload_Block> block, std::size_t size)
+            : pool(pool), block(std::move(block)), bytes(this->block->data()), length(size) {}
+
+        // Refers to size bytes owned elsewhere
+        Pooled_Payload(char* bytes, std::size_t size)
+            : bytes(bytes), length(size) {}
+
+        Pooled_Payload(Pooled_Payload&& other) noexcept {
+            this->swap(other);
+        }
+
+        Pooled_Payload& operator=(Pooled_Payload&& other) noexcept {
+            this->swap(other);
+            return *this;
+        }
+
+        ~Pooled_Payload();
+
+        char* data() { return this->bytes; }
+        const char* data() const { return this->bytes; }
+        std::size_t size() const { return this->length; }
+        bool empty() const { return this->length == 0; }
+
+    private:
+
+        void swap(Pooled_Payload& other) noexcept {
+            std::swap(this->pool, other.pool);
+            std::swap(this->block, other.block);
+            std::swap(this->bytes, other.bytes);
+            std::swap(this->length, other.length);
+        }
+
+        Payload_Pool* pool = nullptr;
+        std::unique_ptr<Payload_Block> block;
+        char* bytes = nullptr;
+        std::size_t length = 0;
+
+};
+
+// Recycles payload blocks so a request does not allocate. Blocks are first
+// written by the thread that acquires them, so with pinned threads a pool's
+// memory stays on the NUMA node of the threads that share it.
+class Payload_Pool {
+
+    public:
+
+        static constexpr std::size_t MAX_FREE_BLOCKS = 256;
+
+        // Returns a block with room for a full payload, of which the first size bytes are in use
+        Pooled_Payload acquire(std::size_t size) {
+
+            std::unique_lock<std::mutex> lock(this->free_lock);
+            if (this->free_blocks.empty()) {
+                lock.unlock();
+                return Pooled_Payload(this, std::make_unique<Payload_Block>(), size);
+            }
+
+            std::unique_ptr<Payload_Block> block = std::move(this->free_blocks.back());
+            this->free_blocks.pop_back();
+            return Pooled_Payload(this, std::move(block), size);
+        }
+
+        void release(std::unique_ptr<Payload_Block> block) {
+
+            std::lock_guard<std::mutex> guard(this->free_lock);
+            if (this->free_blocks.size() < MAX_FREE_BLOCKS) {
+                this->free_blocks.push_back(std::move(block));
+            }
+        }
+
+    private:
+
+        std::vector<std::unique_ptr<Payload_Block>> free_blocks;
+        std::mutex free_lock;
+
+};
+
+inline Pooled_Payload::~Pooled_Payload() {
+    if (this->pool != nullptr && this->block) {
+        this->pool->release(std::move(this->block));
+    }
+}
+
+#endif // PAYLOAD_POOL_H
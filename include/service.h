@@ -1,19 +1,34 @@
 #ifndef SERVICE_H
 #define SERVICE_H
 
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <condition_variable>
+#include <memory>
 #include <message.h> 
 #include <mutex>
 #include <netinet/in.h>
+#include <optional>
+#include <payload-pool.h>
 #include <queue>
 #include <raii_fd.h>
+#include <shared_mutex>
+#include <shm-ring.h>
 #include <status-code.h>
+#include <string>
 #include <sys/epoll.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <thread>
+#include <tls.h>
+#include <topology.h>
 #include <unordered_map>
+#include <utility>
 #include <vector>
+#include <wire-format.h>
 
 #ifdef VERBOSE
 #   include <iostream>
@@ -22,12 +37,58 @@
 #   define IF_VERBOSE(...)
 #endif // VERBOSE
 
+#ifdef DIFFERENTIAL_CHECK
+#   define IF_DIFFERENTIAL_CHECK(...) __VA_ARGS__
+#else
+#   define IF_DIFFERENTIAL_CHECK(...)
+#endif // DIFFERENTIAL_CHECK
+
+// A received request, its payload stays in the pooled block the listener read it into
+struct Request {
+
+    explicit Request(Header h): header(h) {}
+
+    Header header;
+    Pooled_Payload payload;
+};
+
+// A client's shared-memory ring, kept mapped while any Job still refers to one of its slots
+struct Shm_Session {
+
+    Shm_Session() = default;
+
+    ~Shm_Session() {
+        if (this->ring != nullptr) {
+            munmap(this->ring, Shm_Ring::RING_SIZE);
+        }
+    }
+
+    // Null until the client's ring has been received and mapped
+    Shm_Ring::Ring* ring = nullptr;
+    // Set under the sessions lock once the doorbell is registered, a pending session is dropped at deadline
+    bool attached = false;
+    std::chrono::steady_clock::time_point deadline;
+    RAII_FD controlfd;
+    RAII_FD request_doorbell;
+    RAII_FD response_doorbell;
+};
+
 struct Job {
 
-    Job() = default;
+    // A request read from clientfd, answered on it
+    Job(Request request, RAII_FD clientfd)
+        : request(std::move(request)), clientfd(std::move(clientfd)) {}
 
-    Message msg;
+    // A request read from slot of a shared-memory session, answered in place
+    Job(Request request, std::shared_ptr<Shm_Session> session, Shm_Ring::Slot* slot)
+        : request(std::move(request)), session(std::move(session)), slot(slot) {}
+
+    Request request;
     RAII_FD clientfd;
+
+    // Set instead of clientfd for requests made through a shared-memory ring
+    std::shared_ptr<Shm_Session> session;
+    Shm_Ring::Slot* slot = nullptr;
 };
 
 namespace Service_Constants
@@ -42,14 +103,125 @@ namespace Service_Constants
 
     static constexpr int MAX_EPOLL_EVENTS = 10;
 
+    // Sockets default to files in a directory only the service's user can reach, see runtime_path
+    static constexpr const char* RUNTIME_DIRECTORY_NAME = "tcp-compression-service";
+    static constexpr const char* DEFAULT_HANDOFF_NAME = "handoff";
+    static constexpr const char* DEFAULT_UNIX_NAME = "service.sock";
+    static constexpr const char* DEFAULT_SHM_NAME = "shm.sock";
+    // Bounds how long a starting instance waits for a running one to pass its sockets
+    static constexpr std::chrono::seconds HANDOFF_TIMEOUT{2};
+    // How long listeners keep serving already accepted clients once shutdown starts
+    static constexpr std::chrono::milliseconds DRAIN_TIMEOUT{5000};
+    static constexpr int DRAIN_POLL_MS = 50;
+    // How long a shared-memory client has to pass its ring after connecting
+    static constexpr std::chrono::seconds ATTACH_TIMEOUT{2};
+    // How often handshakes and attaches past their deadline are dropped
+    static constexpr std::chrono::seconds SWEEP_INTERVAL{1};
+
     static constexpr std::size_t RECV_BUFFER_SIZE = Message_Constants::MESSAGE_SIZE;
 
-    static constexpr uint16_t GET_STATS_PAYLOAD_SIZE = 2 * sizeof(uint32_t) + 1;
+    static constexpr uint16_t GET_STATS_PAYLOAD_SIZE = Wire_Format::Stats_Layout::SIZE;
 
-    using Buffer = std::array<uint8_t, Message_Constants::PAYLOAD_SIZE>;
+    // Listener receive buffer, payloads are read straight into pooled blocks
+    using Buffer = Wire_Format::Header_Layout::Bytes;
     
 } // namespace Service_Constants
 
+// Every fd in the shared epoll is registered with its kind in the upper half of
+// epoll_event.data.u64 and the fd in the lower half, so a listener can dispatch
+// an event without looking the fd up anywhere
+namespace Watch {
+
+    enum class Kind: uint32_t {
+        // One of the service's own fds, told apart by value
+        SERVICE = 0,
+        // An accepted client whose next request can be read
+        CLIENT = 1,
+        // A TLS client whose handshake is still running
+        HANDSHAKE = 2,
+        // The control socket of a shared-memory session, attaching or attached
+        SHM_CONTROL = 3,
+        // The request eventfd of an attached shared-memory session
+        SHM_DOORBELL = 4
+    };
+
+    constexpr uint64_t tag(Kind kind, int fd) {
+        return (static_cast<uint64_t>(kind) << 32) | static_cast<uint32_t>(fd);
+    }
+
+    constexpr Kind kind_of(uint64_t tag) {
+        return static_cast<Kind>(tag >> 32);
+    }
+
+    constexpr int fd_of(uint64_t tag) {
+        return static_cast<int>(static_cast<uint32_t>(tag));
+    }
+
+} // namespace Watch
+
+struct Service_Config {
+
+    std::size_t num_listeners = Service_Constants::DEFAULT_NUM_LISTENERS;
+    std::size_t num_workers = Service_Constants::DEFAULT_NUM_WORKERS;
+    uint16_t port = Service_Constants::DEFAULT_PORT;
+    int backlog_size = Service_Constants::DEFAULT_BACKLOG_SIZE;
+    // Unix socket used to pass the listening socket to a replacement process, empty disables hot restart
+    std::string handoff_path;
+    // Pins listeners and workers to NUMA nodes and keeps each request on the node that received it
+    bool numa_aware = false;
+    // PEM files for TLS termination on the listening socket, empty serves plaintext
+    std::string tls_certificate;
+    std::string tls_private_key;
+    // Unix socket speaking the same framing as the TCP socket, empty disables it
+    std::string unix_path;
+    // Unix socket where co-located clients attach shared-memory rings, empty disables it
+    std::string shm_path;
+};
+
+// Fills a sockaddr_un for path, throws if it does not fit
+struct sockaddr_un unix_address(const std::string& path);
+
+// Returns name inside $XDG_RUNTIME_DIR/tcp-compression-service, or /tmp/tcp-compression-service-<uid>
+// without one. The directory is created mode 0700 and rejected unless it is owned by us and private.
+std::string runtime_path(const std::string& name);
+
+// Listeners and workers pinned to one NUMA node, sharing a queue and node-local payload buffers
+struct Worker_Group {
+
+    Topology::Node node;
+
+    // Declared before requests so it outlives any queued Job whose payload returns to it
+    Payload_Pool payloads;
+
+    std::queue<Job> requests;
+    std::mutex requests_lock;
+    std::condition_variable waiting_workers;
+    bool stopping = false;
+};
+
+// Header-only responses never change, so they are encoded once at compile time
+// and sent straight from these tables
+namespace Canned_Responses
+{
+
+    using Response = Wire_Format::Header_Layout::Bytes;
+
+    constexpr Response status_response(Status_Code code) {
+        return Wire_Format::encode_header(Header{Message_Constants::MAGIC_NUMBER, 0, static_cast<uint16_t>(code)});
+    }
+
+    static constexpr Response OK = status_response(Status_Code::OK);
+
+    // Indexed by Status_Code
+    static constexpr std::array<Response, 4> STATUS = {
+        status_response(Status_Code::OK),
+        status_response(Status_Code::UNKNOWN_ERROR),
+        status_response(Status_Code::TOO_LARGE),
+        status_response(Status_Code::UNSUPPORTED_TYPE),
+    };
+
+} // namespace Canned_Responses
+
 
 class Service {
 
@@ -57,37 +229,106 @@ class Service {
 
         Service();
         Service(size_t num_listeners, size_t num_workers,  uint16_t port, int backlog_size);
+        explicit Service(const Service_Config& config);
 
+        // Runs until SIGINT/SIGTERM or a hot restart, then drains outstanding requests and returns
         void start();
 
     private:
 
         // Creates and configures server socket for the service
         std::pair<RAII_FD, struct sockaddr_in> create_server_socket();
-        // Constructs a message with <error_code> and empty payload then calls respond
+        // Creates a non-blocking listening Unix socket at path. Replaces a socket file nobody listens on, or
+        // any socket once a running instance answered on the handoff socket, and throws for anything else
+        RAII_FD create_unix_socket(const std::string& path, int backlog);
+        // Accepts a connection on the non-blocking listenfd with accept4 flags, returns -1 if there is none to
+        // take or accepting it failed in a way that only affects that connection. Throws if listenfd is unusable
+        int accept_client(int listenfd, int flags);
+        // Adds fd to the epoll instance shared by the listeners
+        void watch(int fd, uint32_t events, Watch::Kind kind = Watch::Kind::SERVICE);
+        // Re-arms a one-shot fd already in the epoll instance, returns 0 on success
+        bool rearm(int fd, uint32_t events, Watch::Kind kind);
+        // Stops accepting new clients and wakes every listener so they can drain and exit
+        void begin_shutdown();
+        // Returns true once shutdown has begun and DRAIN_TIMEOUT has passed since
+        bool drain_expired() const;
+        // Reads the pending termination signals and begins shutdown
+        void handle_signals();
+
+        // Attempts to take over the listening sockets of a running instance, returns 0 on success
+        bool receive_handoff();
+        // Tells the instance the sockets came from that this one is ready, which lets it begin shutdown
+        void acknowledge_handoff();
+        // Returns 0 if fd is a listening stream socket bound where this instance would bind it
+        bool check_handoff_socket(int fd, int family, const std::string& path) const;
+        // Passes the listening sockets to the instance connecting on handoffd, then begins shutdown once it acknowledges
+        void send_handoff();
+
+        // Accepts a client on shmfd and watches it until it sends its ring
+        void attach_session();
+        // Receives the ring and doorbells once session's control socket is readable and starts watching them
+        void finish_attach(const std::shared_ptr<Shm_Session>& session);
+        // Detaches every session that has not passed its ring by its deadline
+        void expire_attaches();
+        // Unmaps the session owning fd once its outstanding jobs finish, if fd belongs to one
+        void detach_session(int fd);
+        // Returns the session whose request doorbell or control socket is fd
+        std::shared_ptr<Shm_Session> find_session(int fd);
+        // Claims every slot the client has published and services or queues it
+        void handle_doorbell(const std::shared_ptr<Shm_Session>& session, Worker_Group* group);
+        // Writes a response frame into slot and rings the client's response doorbell
+        void complete_slot(Shm_Session* session, Shm_Ring::Slot* slot,
+                           const uint8_t* header, const char* payload, std::size_t payload_size);
+
+        // Sends frame to whichever transport job arrived on
+        void reply(const Job& job, const uint8_t* frame, std::size_t n);
+        // Sends the header and payload of msg to whichever transport job arrived on
+        void reply(const Job& job, const Message& msg);
+        // Sends the canned empty-payload response for <error_code>
         void respond_with_error(int clientfd, Status_Code error_code);
         // Serializes and transmits header and payload defined in msg
-        void respond(int clientfd, const Network_Order_Message& msg);
+        void respond(int clientfd, const Message& msg);
+        // Attempts to send n bytes from bytes to clientfd, returns 0 on success
+        bool send_bytes(int clientfd, const uint8_t* bytes, std::size_t n, int flags = 0);
 
         // Thread function, waits on epoll and reads message from clients
-        void accept_requests();
+        void accept_requests(Worker_Group* group);
+
+        // Accepts a client on serverfd and starts its TLS handshake
+        void accept_tls_client();
+        // Drives the handshake of clientfd after it became ready, then watches it as a client once done
+        void continue_handshake(int clientfd);
+        // Drains sweepfd and drops handshakes and attaches that passed their deadline
+        void sweep();
+        // Drops every client whose handshake passed its deadline
+        void expire_handshakes();
+        // Closes a client that was never handed to handle_client
+        void drop_client(int clientfd);
 
-        // Attempts to read n bytes from clientfd to buffer, returns 0 on success
-        bool recv_bytes(int clientfd, Service_Constants::Buffer* buffer, std::size_t n);
+        // Attempts to read n bytes from clientfd to destination, returns 0 on success. Gives up on
+        // a client that is still sending once the drain deadline passes
+        bool recv_bytes(int clientfd, void* destination, std::size_t n);
+        // Blocks until clientfd may be readable, returns 1 if the drain deadline passed first
+        bool wait_readable(int clientfd);
         // Attempts to create a Header by reading from clientfd, returns empty optional on failure
         std::optional<Header> create_header(int clientfd, Service_Constants::Buffer* buffer);
-        // Attempts to create a Message by reading from clientfd, returns an empty optional on failure
-        std::optional<Message> create_message(int clientfd, Header h, Service_Constants::Buffer* buffer);
-        // Packages clientfd and msg into job stuct and enqueues it. This transfers ownership of clientfd
-        void publish_message(RAII_FD clientfd, Message msg);
+        // Attempts to create a Request by reading its payload from clientfd into a block from the group's pool,
+        // returns an empty optional on failure
+        std::optional<Request> create_message(int clientfd, Header h, Worker_Group* group);
+        // Packages clientfd and request into job stuct and enqueues it on group. This transfers ownership of clientfd
+        void publish_message(RAII_FD clientfd, Request request, Worker_Group* group);
+        // Enqueues job on group
+        void publish_job(Job job, Worker_Group* group);
         // Attempts to read and publish a message from clientfd
-        void handle_client(RAII_FD clientfd, Service_Constants::Buffer* buffer);
+        void handle_client(RAII_FD clientfd, Service_Constants::Buffer* buffer, Worker_Group* group);
 
-        // Thread function, waits on requests queue and services requests based on type
-        void process_requests();
+        // Thread function, waits on the group's requests queue and services requests based on type
+        void process_requests(Worker_Group* group);
+        // Pins the calling thread to the group's node when NUMA placement is enabled
+        void pin_to(const Worker_Group& group);
 
-        // Responds to client with empty message and OK status
-        void ping(const Job& job);
+        // Responds to client with empty message and OK status, called inline by listeners
+        void ping(int clientfd);
         // Responds to client with bytes sent/recieved and compression ratio
         void get_stats(const Job& job);
         // Resets bytes send/recieved and compression ratio to zero
@@ -97,9 +338,16 @@ class Service {
 
         std::vector<std::thread> listeners;
         std::vector<std::thread> workers;
-        std::queue<Job> requests;
-        std::mutex requests_lock;
-        std::condition_variable waiting_workers;
+        // One group per NUMA node in use, or a single unpinned group
+        std::vector<std::unique_ptr<Worker_Group>> groups;
+
+        std::atomic<bool> shutting_down = false;
+        // Listeners that have seen shutdown, the last one stops watching shutdownfd
+        std::atomic<std::size_t> draining_listeners = 0;
+        // Clients accepted into the epoll whose request has not been read yet
+        std::atomic<std::size_t> open_clients = 0;
+        // Set by begin_shutdown, bounds both waiting for open_clients and reads from a stalled client
+        std::atomic<std::chrono::steady_clock::time_point> drain_deadline = std::chrono::steady_clock::time_point::max();
 
         uint32_t total_bytes_recieved;
         uint32_t total_bytes_sent;
@@ -108,12 +356,40 @@ class Service {
 
         RAII_FD serverfd;
         RAII_FD epollfd;
+        RAII_FD signalfd;
+        RAII_FD shutdownfd;
+        RAII_FD handoffd;
+        // Spare descriptor released to shed a connection when the process runs out of descriptors
+        RAII_FD reservefd;
+        std::mutex reserve_lock;
+        // Connection to the instance the sockets were taken from, open until acknowledge_handoff
+        RAII_FD handoff_control;
+        RAII_FD unixfd;
+        RAII_FD shmfd;
         struct sockaddr_in addr;
 
+        // Keyed by both the request doorbell and the control socket of each session. Only session
+        // events look here, a raw pointer in the epoll data could outlive a concurrent detach
+        std::unordered_map<int, std::shared_ptr<Shm_Session>> sessions;
+        std::shared_mutex sessions_lock;
+
         uint16_t port;
         int backlog_size;
         std::size_t num_listeners;
         std::size_t num_workers;
+        std::string handoff_path;
+        std::string unix_path;
+        std::string shm_path;
+        bool numa_aware;
+        // Set when a running instance answered on the handoff socket, its socket files are ours to replace
+        bool replacing = false;
+        // Set when TLS is configured, clients are handshaken on accept and then use kTLS
+        std::unique_ptr<Tls::Context> tls;
+        // Handshakes in progress keyed by client fd. A listener takes one out while it advances it
+        std::unordered_map<int, std::unique_ptr<Tls::Handshake>> handshakes;
+        std::mutex handshakes_lock;
+        // Periodic timer that wakes a listener to run sweep, only created with TLS or shared memory
+        RAII_FD sweepfd;
 
 };
 
@@ -0,0 +1,66 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <fcntl.h>
+#include <message.h>
+
+// Shared-memory transport for clients on the same host. The client creates a
+// memfd of RING_SIZE bytes with MFD_ALLOW_SEALING, writes magic_number and
+// num_slots and adds REQUIRED_SEALS. It creates a request and a response
+// eventfd, then connects to the service's shm socket and sends one byte
+// carrying [memfd, request eventfd, response eventfd] as SCM_RIGHTS. The
+// service answers with one Status_Code byte. A memfd without the seals is
+// refused, since a client that could shrink it would make the service fault
+// on its mapping. The connection stays open for
+// the lifetime of the session, and closing it detaches the ring.
+//
+// To make a request the client writes a frame (header followed by payload, the
+// same framing as the socket protocol) into a FREE slot. It then stores REQUEST
+// in the slot's state and writes to the request eventfd. The service compresses
+// the payload in place, writes the response frame back into the same slot,
+// stores RESPONSE and writes to the response eventfd. The client reads the
+// response and stores FREE.
+//
+// The service makes both eventfds non-blocking. That flag is shared with the
+// client's descriptors, so the client waits for the response eventfd with
+// poll or epoll before reading it. A client that never reads it, letting
+// the counter fill up, is detached.
+namespace Shm_Ring {
+
+    static constexpr uint32_t MAGIC_NUMBER = 0x53484d52;
+    static constexpr uint32_t NUM_SLOTS = 64;
+    static constexpr std::size_t NUM_ATTACH_FDS = 3;
+    // The ring can never shrink under the service's mapping, nor can that guarantee be lifted
+    static constexpr int REQUIRED_SEALS = F_SEAL_SHRINK | F_SEAL_SEAL;
+
+    enum class Slot_State: uint32_t {
+        FREE = 0,
+        REQUEST = 1,
+        BUSY = 2,
+        RESPONSE = 3
+    };
+
+    struct alignas(64) Slot {
+        std::atomic<uint32_t> state;
+        uint8_t frame[Message_Constants::MESSAGE_SIZE];
+    };
+
+    struct Ring {
+        uint32_t magic_number;
+        uint32_t num_slots;
+        Slot slots[NUM_SLOTS];
+    };
+
+    static_assert(std::atomic<uint32_t>::is_always_lock_free, "Slot state must be usable across processes");
+
+    static constexpr std::size_t RING_SIZE = sizeof(Ring);
+    static constexpr std::size_t SLOT_SIZE = sizeof(Slot);
+    static constexpr std::size_t SLOTS_OFFSET = offsetof(Ring, slots);
+    static constexpr std::size_t FRAME_OFFSET = offsetof(Slot, frame);
+
+} // namespace Shm_Ring
+
+#endif // SHM_RING_H
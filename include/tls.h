@@ -0,0 +1,74 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <chrono>
+#include <string>
+
+struct ssl_ctx_st;
+struct ssl_st;
+
+namespace Tls {
+
+    // Bounds how long a client may take to complete its handshake
+    static constexpr std::chrono::seconds HANDSHAKE_TIMEOUT{5};
+
+    enum class Progress {
+        DONE,
+        WANT_READ,
+        WANT_WRITE,
+        FAILED
+    };
+
+    // Server-side TLS that only performs handshakes. Record encryption is handed
+    // to the kernel (kTLS) so the plain send/recv calls used for responses keep
+    // working on the client socket, and OpenSSL drops out of the data path.
+    class Context {
+
+        public:
+
+            // Loads a PEM certificate chain and private key, throws if either is invalid or kTLS is unavailable
+            Context(const std::string& certificate_path, const std::string& private_key_path);
+            ~Context();
+
+            Context(const Context&) = delete;
+            Context& operator=(const Context&) = delete;
+
+        private:
+
+            friend class Handshake;
+
+            ssl_ctx_st* ctx = nullptr;
+
+    };
+
+    // Server side of one handshake on a non-blocking client socket. It is driven
+    // forward each time the socket becomes ready, so no thread ever waits on a
+    // client. Once it is DONE the session keys are installed in the kernel and
+    // the Handshake can be destroyed without affecting the connection.
+    class Handshake {
+
+        public:
+
+            // Does not take ownership of clientfd
+            Handshake(const Context& context, int clientfd);
+            ~Handshake();
+
+            Handshake(const Handshake&) = delete;
+            Handshake& operator=(const Handshake&) = delete;
+
+            // Continues the handshake as far as the socket allows. WANT_READ and WANT_WRITE say what
+            // to wait for before calling it again, DONE means both directions are offloaded to the kernel
+            Progress advance();
+
+            // The client is dropped if the handshake is still running at this point
+            const std::chrono::steady_clock::time_point deadline;
+
+        private:
+
+            ssl_st* ssl = nullptr;
+
+    };
+
+} // namespace Tls
+
+#endif // TLS_H
@@ -0,0 +1,27 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <string>
+#include <vector>
+
+namespace Topology {
+
+    struct Node {
+        int id;
+        std::vector<int> cpus;
+    };
+
+    // Reads the NUMA nodes that have CPUs from sysfs, returns a single node with no CPUs if it is unavailable
+    std::vector<Node> discover();
+
+    // Parses a sysfs cpu/node list such as "0-3,8,10-11"
+    std::vector<int> parse_list(const std::string& list);
+
+    // Restricts the calling thread to cpus, returns 0 on success
+    bool pin_current_thread(const std::vector<int>& cpus);
+
+    static constexpr const char* NODE_ROOT = "/sys/devices/system/node/";
+
+} // namespace Topology
+
+#endif // TOPOLOGY_H
@@ -0,0 +1,117 @@
+#ifndef WIRE_FORMAT_H
+#define WIRE_FORMAT_H
+
+#include <array>
+#include <cstdint>
+#include <message.h>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+// Fixed-layout messages are described once as a list of field types and get
+// generated big-endian encode/decode. Fields are assembled with shifts, so the
+// buffers need no particular alignment and the byte order does not depend on
+// the host.
+namespace Wire_Format {
+
+    // Writes value to out in network byte order
+    template<typename T>
+    constexpr void store(uint8_t* out, T value) {
+
+        static_assert(std::is_unsigned_v<T>, "Wire fields must be unsigned integers");
+
+        for (std::size_t i = 0; i < sizeof(T); i++) {
+            out[i] = static_cast<uint8_t>(value >> (8 * (sizeof(T) - 1 - i)));
+        }
+
+    }
+
+    // Reads a value of type T stored in network byte order from in
+    template<typename T>
+    constexpr T load(const uint8_t* in) {
+
+        static_assert(std::is_unsigned_v<T>, "Wire fields must be unsigned integers");
+
+        T value = 0;
+        for (std::size_t i = 0; i < sizeof(T); i++) {
+            value = static_cast<T>((value << 8) | in[i]);
+        }
+
+        return value;
+    }
+
+    template<typename... Fields>
+    struct Layout {
+
+        static constexpr std::size_t SIZE = (sizeof(Fields) + ...);
+
+        using Bytes = std::array<uint8_t, SIZE>;
+        using Values = std::tuple<Fields...>;
+
+        static constexpr void encode(uint8_t* out, Fields... values) {
+            std::size_t offset = 0;
+            ((store<Fields>(out + offset, values), offset += sizeof(Fields)), ...);
+        }
+
+        static constexpr Bytes encode(Fields... values) {
+            Bytes bytes{};
+            encode(bytes.data(), values...);
+            return bytes;
+        }
+
+        static constexpr Values decode(const uint8_t* in) {
+            return decode(in, std::index_sequence_for<Fields...>{});
+        }
+
+        private:
+
+            template<std::size_t... I>
+            static constexpr Values decode(const uint8_t* in, std::index_sequence<I...> /*unused*/) {
+                return Values{load<Fields>(in + offset_of<I>())...};
+            }
+
+            template<std::size_t I>
+            static constexpr std::size_t offset_of() {
+                constexpr std::array<std::size_t, sizeof...(Fields)> sizes = {sizeof(Fields)...};
+                std::size_t offset = 0;
+                for (std::size_t i = 0; i < I; i++) {
+                    offset += sizes[i];
+                }
+                return offset;
+            }
+    };
+
+    // magic_number, payload_length, code
+    using Header_Layout = Layout<uint32_t, uint16_t, uint16_t>;
+    // total_bytes_recieved, total_bytes_sent, compression_ratio
+    using Stats_Layout = Layout<uint32_t, uint32_t, uint8_t>;
+
+    static_assert(Header_Layout::SIZE == Message_Constants::HEADER_SIZE);
+
+    constexpr void encode_header(uint8_t* out, const Header& h) {
+        Header_Layout::encode(out, h.magic_number, h.payload_length, h.code);
+    }
+
+    constexpr Header_Layout::Bytes encode_header(const Header& h) {
+        return Header_Layout::encode(h.magic_number, h.payload_length, h.code);
+    }
+
+    constexpr Header decode_header(const uint8_t* in) {
+        auto [magic_number, payload_length, code] = Header_Layout::decode(in);
+        return Header{magic_number, payload_length, code};
+    }
+
+    // Header followed by payload in a single buffer, for responses whose size is known at compile time
+    template<typename Payload_Layout>
+    using Frame = std::array<uint8_t, Header_Layout::SIZE + Payload_Layout::SIZE>;
+
+    template<typename Payload_Layout>
+    constexpr Frame<Payload_Layout> frame_template(uint16_t code) {
+        Frame<Payload_Layout> frame{};
+        encode_header(frame.data(), Header{Message_Constants::MAGIC_NUMBER, Payload_Layout::SIZE, code});
+        return frame;
+    }
+
+} // namespace Wire_Format
+
+#endif // WIRE_FORMAT_H
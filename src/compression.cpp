@@ -1,7 +1,8 @@
 #include <cctype>
+#include <cstdio>
 #include <cstring>
 #include <compression.h>
-#include <helpers.h>
+#include <string_view>
 
 void write_char(char c, std::size_t count, Compression::Buffer* count_buffer, std::vector<char>* output) {
 
@@ -23,9 +24,9 @@ void write_char(char c, std::size_t count, Compression::Buffer* count_buffer, st
     }
 }
 
-std::optional<std::vector<char>> Compression::compress(const std::vector<char>& input) {
+std::optional<std::vector<char>> Compression::compress(const char* input, std::size_t size) {
 
-    if (input.empty()) {
+    if (size == 0) {
         return std::vector<char>();
     }
 
@@ -35,7 +36,7 @@ std::optional<std::vector<char>> Compression::compress(const std::vector<char>&
     std::size_t count = 0;
     char current_char = input[0];
     
-    for (const char c: input) {
+    for (const char c: std::string_view(input, size)) {
 
         if (!islower(c)) {
             return std::nullopt;
@@ -0,0 +1,241 @@
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <service.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Marks which optional listening sockets follow serverfd in the SCM_RIGHTS array
+enum Handoff_Flags: char {
+	HANDOFF_UNIX = 1 << 0,
+	HANDOFF_SHM = 1 << 1,
+};
+
+static constexpr std::size_t MAX_HANDOFF_FDS = 3;
+
+// Sent back by the new instance once it has validated the sockets and finished constructing
+static constexpr char HANDOFF_ACK = 1;
+
+bool Service::receive_handoff() {
+
+	if (this->handoff_path.empty()) {
+		return true;
+	}
+
+	int controlfd_raw = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (controlfd_raw == -1) {
+		throw std::runtime_error("Handoff socket creation failed");
+	}
+	RAII_FD controlfd(controlfd_raw);
+
+	struct sockaddr_un addr = unix_address(this->handoff_path);
+	if (connect(controlfd.get(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
+		// No running instance to take over from
+		return true;
+	}
+
+	// Only take sockets from an instance running as the same user
+	struct ucred peer = {};
+	socklen_t peer_len = sizeof(peer);
+	if (getsockopt(controlfd.get(), SOL_SOCKET, SO_PEERCRED, &peer, &peer_len) == -1 || peer.uid != geteuid()) {
+		throw std::runtime_error("Handoff peer is not owned by this user");
+	}
+	this->replacing = true;
+
+	// A running instance that is already draining no longer answers on its handoff socket
+	struct timeval timeout = {std::chrono::seconds(Service_Constants::HANDOFF_TIMEOUT).count(), 0};
+	setsockopt(controlfd.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	char flags = 0;
+	struct iovec iov = {&flags, sizeof(flags)};
+
+	alignas(struct cmsghdr) char control[CMSG_SPACE(MAX_HANDOFF_FDS * sizeof(int))];
+	struct msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t num_bytes = recvmsg(controlfd.get(), &msg, MSG_CMSG_CLOEXEC);
+	if (num_bytes == 0 || (num_bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))) {
+		IF_VERBOSE (
+			printf("Running instance did not hand over its sockets, starting fresh\n");
+		)
+		return true;
+	}
+
+	// Until this instance acknowledges, the running one keeps serving, so failing from here on is safe
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if (num_bytes < 0 || (msg.msg_flags & MSG_CTRUNC) || cmsg == nullptr ||
+			cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		throw std::runtime_error("Handoff receive failed");
+	}
+
+	std::size_t num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	std::array<int, MAX_HANDOFF_FDS> fds;
+	memcpy(fds.data(), CMSG_DATA(cmsg), num_fds * sizeof(int));
+
+	// Take ownership first so every received fd is closed on failure
+	std::array<RAII_FD, MAX_HANDOFF_FDS> received;
+	for (std::size_t i = 0; i < num_fds; i++) {
+		received[i] = RAII_FD(fds[i]);
+	}
+
+	std::size_t expected_fds = 1 + ((flags & HANDOFF_UNIX) != 0) + ((flags & HANDOFF_SHM) != 0);
+	if (num_fds != expected_fds) {
+		throw std::runtime_error("Handoff receive failed");
+	}
+
+	std::size_t next = 0;
+	RAII_FD serverfd_temp = std::move(received[next++]);
+	RAII_FD unixfd_temp = (flags & HANDOFF_UNIX) ? std::move(received[next++]) : RAII_FD();
+	RAII_FD shmfd_temp = (flags & HANDOFF_SHM) ? std::move(received[next++]) : RAII_FD();
+
+	if (this->check_handoff_socket(serverfd_temp.get(), AF_INET, "")) {
+		throw std::runtime_error("Handoff sent an unexpected server socket");
+	}
+	this->serverfd = std::move(serverfd_temp);
+
+	// Sockets this instance is not configured for are closed
+	if (unixfd_temp.get() != -1 && !this->unix_path.empty()) {
+		if (this->check_handoff_socket(unixfd_temp.get(), AF_UNIX, this->unix_path)) {
+			throw std::runtime_error("Handoff sent an unexpected Unix socket");
+		}
+		this->unixfd = std::move(unixfd_temp);
+	}
+	if (shmfd_temp.get() != -1 && !this->shm_path.empty()) {
+		if (this->check_handoff_socket(shmfd_temp.get(), AF_UNIX, this->shm_path)) {
+			throw std::runtime_error("Handoff sent an unexpected shared memory socket");
+		}
+		this->shmfd = std::move(shmfd_temp);
+	}
+
+	IF_VERBOSE (
+		printf("Took over %zu listening sockets from running instance\n", num_fds);
+	)
+
+	this->handoff_control = std::move(controlfd);
+
+	return false;
+}
+
+void Service::acknowledge_handoff() {
+
+	if (this->handoff_control.get() == -1) {
+		return;
+	}
+
+	// If this fails the running instance times out and keeps serving next to this one
+	if (send(this->handoff_control.get(), &HANDOFF_ACK, sizeof(HANDOFF_ACK), MSG_NOSIGNAL) != sizeof(HANDOFF_ACK)) {
+		IF_VERBOSE (
+			printf("Handoff acknowledgement failed\n");
+		)
+	}
+
+	this->handoff_control = RAII_FD();
+
+}
+
+bool Service::check_handoff_socket(int fd, int family, const std::string& path) const {
+
+	int type = 0;
+	socklen_t len = sizeof(type);
+	if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == -1 || type != SOCK_STREAM) {
+		return true;
+	}
+
+	int listening = 0;
+	len = sizeof(listening);
+	if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) == -1 || listening == 0) {
+		return true;
+	}
+
+	struct sockaddr_storage bound = {};
+	len = sizeof(bound);
+	if (getsockname(fd, reinterpret_cast<sockaddr*>(&bound), &len) == -1 || bound.ss_family != family) {
+		return true;
+	}
+
+	if (family == AF_INET) {
+		return reinterpret_cast<struct sockaddr_in*>(&bound)->sin_port != htons(this->port);
+	}
+
+	const auto* bound_unix = reinterpret_cast<struct sockaddr_un*>(&bound);
+	return strncmp(bound_unix->sun_path, path.c_str(), sizeof(bound_unix->sun_path)) != 0;
+}
+
+void Service::send_handoff() {
+
+	int controlfd_raw = this->accept_client(this->handoffd.get(), SOCK_CLOEXEC);
+	if (controlfd_raw == -1) {
+		return;
+	}
+	RAII_FD controlfd(controlfd_raw);
+
+	struct ucred peer = {};
+	socklen_t peer_len = sizeof(peer);
+	if (getsockopt(controlfd.get(), SOL_SOCKET, SO_PEERCRED, &peer, &peer_len) == -1 || peer.uid != geteuid()) {
+		IF_VERBOSE (
+			printf("Refusing handoff to process owned by another user\n");
+		)
+		return;
+	}
+
+	IF_VERBOSE (
+		printf("Handing listening sockets to new instance\n");
+	)
+
+	std::array<int, MAX_HANDOFF_FDS> fds;
+	std::size_t num_fds = 0;
+	char flags = 0;
+
+	fds[num_fds++] = this->serverfd.get();
+	if (this->unixfd.get() != -1) {
+		fds[num_fds++] = this->unixfd.get();
+		flags |= HANDOFF_UNIX;
+	}
+	if (this->shmfd.get() != -1) {
+		fds[num_fds++] = this->shmfd.get();
+		flags |= HANDOFF_SHM;
+	}
+
+	struct iovec iov = {&flags, sizeof(flags)};
+
+	alignas(struct cmsghdr) char control[CMSG_SPACE(MAX_HANDOFF_FDS * sizeof(int))] = {};
+	struct msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(num_fds * sizeof(int));
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds.data(), num_fds * sizeof(int));
+
+	if (sendmsg(controlfd.get(), &msg, MSG_NOSIGNAL) == -1) {
+		// The new instance went away, keep serving
+		IF_VERBOSE (
+			printf("Handoff send failed\n");
+		)
+		return;
+	}
+
+	// A new instance that rejects the sockets or fails to start must not take the service down with it,
+	// so keep serving until it confirms. This holds one listener for at most HANDOFF_TIMEOUT.
+	struct timeval timeout = {std::chrono::seconds(Service_Constants::HANDOFF_TIMEOUT).count(), 0};
+	setsockopt(controlfd.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	char ack = 0;
+	if (recv(controlfd.get(), &ack, sizeof(ack), 0) != sizeof(ack) || ack != HANDOFF_ACK) {
+		IF_VERBOSE (
+			printf("New instance did not confirm the handoff, keep serving\n");
+		)
+		return;
+	}
+
+	// The new instance now accepts on the same sockets, drain and let it take over
+	this->begin_shutdown();
+
+}
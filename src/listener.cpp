@@ -1,52 +1,169 @@
 #include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <fcntl.h>
 #include <list>
 #include <message.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <optional>
 #include <request-code.h>
 #include <service.h>
 #include <status-code.h>
 #include <sys/ioctl.h>
+#include <wire-format.h>
+
+// Registers an accepted client, closes it and returns false if the epoll instance refuses it
+bool add_client(int epollfd, int clientfd, epoll_event* epoll_ev) {
+
+	// One-shot so exactly one listener takes the client, which keeps open_clients exact
+	epoll_ev->events = EPOLLIN | EPOLLONESHOT;
+	epoll_ev->data.u64 = Watch::tag(Watch::Kind::CLIENT, clientfd);
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, clientfd, epoll_ev)) {
+		// ENOSPC or ENOMEM, only this client is lost
+		IF_VERBOSE (
+			printf("Epoll CTL add new client failed\n");
+		)
+		close(clientfd);
+		return false;
+	}
+
+	return true;
+}
 
-void add_client(int epollfd, int serverfd, 
-                struct sockaddr_in* addr, epoll_event* epoll_ev) {
+// Returns 0 on success
+bool set_nodelay(int clientfd, bool enabled) {
+	int value = enabled ? 1 : 0;
+	return setsockopt(clientfd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value)) == -1;
+}
 
-	int addrlen = sizeof(struct sockaddr_in);
+void Service::accept_tls_client() {
 
-	int new_clientfd = accept(serverfd, reinterpret_cast<sockaddr*>(addr), reinterpret_cast<socklen_t*>(&addrlen));
-	if (new_clientfd == -1) {
-		throw std::runtime_error("Accept connection failed");
+	// Non-blocking until the handshake is done, so no listener waits on a slow client
+	int clientfd = this->accept_client(this->serverfd.get(), SOCK_NONBLOCK);
+	if (clientfd == -1) {
+		return;
 	}
 
-	epoll_ev->events = EPOLLIN | EPOLLEXCLUSIVE;
-	epoll_ev->data.fd = new_clientfd;
-	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, new_clientfd, epoll_ev)) {
-		throw std::runtime_error("Epoll CTL add new client failed");
+	// A TLS 1.2 server flight is several small writes, Nagle would hold the later ones for a delayed ACK
+	set_nodelay(clientfd, true);
+
+	// Registered before it is watched so its first event always finds it
+	{
+		std::lock_guard<std::mutex> guard(this->handshakes_lock);
+		this->handshakes[clientfd] = std::make_unique<Tls::Handshake>(*this->tls, clientfd);
 	}
 
+	++this->open_clients;
+	this->watch(clientfd, EPOLLIN | EPOLLONESHOT, Watch::Kind::HANDSHAKE);
+
 }
 
-std::optional<Message> Service::create_message(int clientfd, Header h, Service_Constants::Buffer* buffer) {
+void Service::continue_handshake(int clientfd) {
 
-	Message msg(std::move(h));
+	std::unique_ptr<Tls::Handshake> handshake;
+	{
+		std::lock_guard<std::mutex> guard(this->handshakes_lock);
+		auto it = this->handshakes.find(clientfd);
+		if (it == this->handshakes.end()) {
+			// Expired while the event was pending
+			return;
+		}
+		handshake = std::move(it->second);
+		this->handshakes.erase(it);
+	}
 
-	if (h.payload_length > 0) {
-		if (h.code != static_cast<uint16_t>(Request_Code::COMPRESS)) {
-			this->respond_with_error(clientfd, Status_Code::UNSUPPORTED_TYPE);
-			return std::nullopt;
+	Tls::Progress progress = handshake->advance();
+
+	if (progress == Tls::Progress::WANT_READ || progress == Tls::Progress::WANT_WRITE) {
+		uint32_t events = (progress == Tls::Progress::WANT_READ ? EPOLLIN : EPOLLOUT) | EPOLLONESHOT;
+
+		// Re-armed under the lock so expire_handshakes cannot close clientfd in between
+		std::lock_guard<std::mutex> guard(this->handshakes_lock);
+		this->handshakes[clientfd] = std::move(handshake);
+		this->rearm(clientfd, events, Watch::Kind::HANDSHAKE);
+		return;
+	}
+
+	handshake.reset();
+
+	// Responses are sent with blocking writes and corked with MSG_MORE like on any other client
+	int flags = fcntl(clientfd, F_GETFL);
+	if (progress == Tls::Progress::DONE && flags != -1 && fcntl(clientfd, F_SETFL, flags & ~O_NONBLOCK) != -1 &&
+			!set_nodelay(clientfd, false) && !this->rearm(clientfd, EPOLLIN | EPOLLONESHOT, Watch::Kind::CLIENT)) {
+		return;
+	}
+
+	IF_VERBOSE (
+		printf("TLS handshake failed\n");
+	)
+
+	this->drop_client(clientfd);
+
+}
+
+void Service::sweep() {
+
+	uint64_t expirations = 0;
+	if (read(this->sweepfd.get(), &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) {
+		throw std::runtime_error("Timerfd read failed");
+	}
+
+	if (this->tls) {
+		this->expire_handshakes();
+	}
+	if (this->shmfd.get() != -1) {
+		this->expire_attaches();
+	}
+
+}
+
+void Service::expire_handshakes() {
+
+	auto now = std::chrono::steady_clock::now();
+	std::vector<int> expired;
+	{
+		std::lock_guard<std::mutex> guard(this->handshakes_lock);
+		for (auto it = this->handshakes.begin(); it != this->handshakes.end();) {
+			if (it->second->deadline <= now) {
+				expired.push_back(it->first);
+				it = this->handshakes.erase(it);
+			} else {
+				++it;
+			}
 		}
 	}
 
-	if (this->recv_bytes(clientfd, buffer, h.payload_length)) {
-		return std::nullopt;
+	for (int clientfd: expired) {
+		IF_VERBOSE (
+			printf("TLS handshake timed out\n");
+		)
+		this->drop_client(clientfd);
 	}
 
-	auto start = buffer->begin();
-	auto end = start + h.payload_length;
-	msg.payload.assign(start, end);
+}
+
+void Service::drop_client(int clientfd) {
+
+	epoll_ctl(this->epollfd.get(), EPOLL_CTL_DEL, clientfd, nullptr);
+	close(clientfd);
+	--this->open_clients;
 
-	return msg;
+}
+
+std::optional<Request> Service::create_message(int clientfd, Header h, Worker_Group* group) {
+
+	Request request(h);
+
+	if (h.payload_length > 0) {
+		request.payload = group->payloads.acquire(h.payload_length);
+		if (this->recv_bytes(clientfd, request.payload.data(), h.payload_length)) {
+			return std::nullopt;
+		}
+	}
+
+	return request;
 }
 
 
@@ -54,37 +171,19 @@ std::optional<Header> Service::create_header(int clientfd, Service_Constants::Bu
 
 	assert(clientfd != -1);
 
-	if (this->recv_bytes(clientfd, buffer, Message_Constants::HEADER_SIZE)) {
+	if (this->recv_bytes(clientfd, buffer->data(), Message_Constants::HEADER_SIZE)) {
 		return std::nullopt;
 	}
 
-	Header h;
-	
-	uint8_t* read_head = buffer->data();
-	
-	h.magic_number = *reinterpret_cast<uint32_t*>(read_head);
-	read_head += sizeof(h.magic_number);
-	h.payload_length = *reinterpret_cast<uint16_t*>(read_head);
-	read_head += sizeof(h.payload_length);
-	h.code = *reinterpret_cast<uint16_t*>(read_head);
-	h.set_host_order();
+	Header h = Wire_Format::decode_header(buffer->data());
 
 	IF_VERBOSE (
 		printf("Message:\n- magic_number: %lu\n- payload_length: %u\n- code: %u\n", h.magic_number, h.payload_length, h.code);
 	)
 
-	if (h.magic_number != Message_Constants::MAGIC_NUMBER) {
-		this->respond_with_error(clientfd, Status_Code::UNKNOWN_ERROR);
-		return std::nullopt;
-	}
-
-	if (h.code < 1 or h.code > 4) {
-		this->respond_with_error(clientfd, Status_Code::UNSUPPORTED_TYPE);
-		return std::nullopt;
-	}
-
-	if (h.payload_length > Message_Constants::PAYLOAD_SIZE) {
-		this->respond_with_error(clientfd, Status_Code::TOO_LARGE);
+	Status_Code status = check_header(h);
+	if (status != Status_Code::OK) {
+		this->respond_with_error(clientfd, status);
 		return std::nullopt;
 	}
 
@@ -92,15 +191,21 @@ std::optional<Header> Service::create_header(int clientfd, Service_Constants::Bu
 }
 
 
-void Service::publish_message(RAII_FD clientfd, Message msg) {
+void Service::publish_message(RAII_FD clientfd, Request request, Worker_Group* group) {
 
 	assert(clientfd.get() != -1);
 
-	Job job = {std::move(msg), std::move(clientfd)};
+	Job job(std::move(request), std::move(clientfd));
+
+	this->publish_job(std::move(job), group);
+
+}
+
+void Service::publish_job(Job job, Worker_Group* group) {
 
-	std::lock_guard<std::mutex> guard(this->requests_lock);
-	this->requests.emplace(std::move(job));
-	this->waiting_workers.notify_one();
+	std::lock_guard<std::mutex> guard(group->requests_lock);
+	group->requests.emplace(std::move(job));
+	group->waiting_workers.notify_one();
 
 	IF_VERBOSE (
 		printf("Published job to queue\n");
@@ -108,7 +213,7 @@ void Service::publish_message(RAII_FD clientfd, Message msg) {
 
 }
 
-void Service::handle_client(RAII_FD clientfd, Service_Constants::Buffer* buffer) {
+void Service::handle_client(RAII_FD clientfd, Service_Constants::Buffer* buffer, Worker_Group* group) {
 
 	assert(clientfd.get() != -1);
 
@@ -118,49 +223,141 @@ void Service::handle_client(RAII_FD clientfd, Service_Constants::Buffer* buffer)
 	}
 	Header h = header_opt.value();
 
-	auto msg_opt = this->create_message(clientfd.get(), h, buffer);
-	if (!msg_opt.has_value()) {
+	auto request_opt = this->create_message(clientfd.get(), h, group);
+	if (!request_opt.has_value()) {
+		return;
+	}
+
+	// PING is the health-check path, answer it here rather than round-trip through the queue
+	if (h.code == static_cast<uint16_t>(Request_Code::PING)) {
+		this->ping(clientfd.get());
 		return;
 	}
-	Message msg = msg_opt.value();
 
-	this->publish_message(std::move(clientfd), std::move(msg));
+	this->publish_message(std::move(clientfd), std::move(request_opt.value()), group);
 
 }
  
-void Service::accept_requests() {
+void Service::accept_requests(Worker_Group* group) {
+
+	// Pin before the receive buffer is touched so its pages land on the group's node
+	this->pin_to(*group);
 
 	epoll_event epoll_ev, epoll_events[Service_Constants::MAX_EPOLL_EVENTS];
 
 	int num_fds = 0;
+	int timeout = -1;
 	Service_Constants::Buffer buffer;
 	while (true) {
 
-		num_fds = epoll_wait(this->epollfd.get(), epoll_events, Service_Constants::MAX_EPOLL_EVENTS, -1);
+		num_fds = epoll_wait(this->epollfd.get(), epoll_events, Service_Constants::MAX_EPOLL_EVENTS, timeout);
 		if (num_fds == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
 			throw std::runtime_error("Epoll wait failed");
 		}
 
 		for (int i = 0; i < num_fds; i++) {
-			if (epoll_events[i].data.fd == this->serverfd.get()) {
+
+			Watch::Kind kind = Watch::kind_of(epoll_events[i].data.u64);
+			int fd = Watch::fd_of(epoll_events[i].data.u64);
+
+			if (kind == Watch::Kind::CLIENT) {
 
 				IF_VERBOSE (
-					printf("Accepting client\n");
+					printf("Handling client\n");
 				)
 
-				add_client(this->epollfd.get(), this->serverfd.get(), &this->addr, &epoll_ev);
+				assert(fd != -1);
+				epoll_ctl(this->epollfd.get(), EPOLL_CTL_DEL, fd, NULL);
+				--this->open_clients;
+				handle_client(std::move(RAII_FD(fd)), &buffer, group);
 
-			} else {
+			} else if (kind == Watch::Kind::HANDSHAKE) {
+
+				this->continue_handshake(fd);
+
+			} else if (kind == Watch::Kind::SHM_DOORBELL) {
+
+				if (auto session = this->find_session(fd)) {
+					this->handle_doorbell(session, group);
+				}
+
+			} else if (kind == Watch::Kind::SHM_CONTROL) {
+
+				if (auto session = this->find_session(fd)) {
+					if (session->ring == nullptr) {
+						this->finish_attach(session);
+					} else {
+						// The client closed its control socket
+						this->detach_session(fd);
+					}
+				}
+
+			} else if (fd == this->serverfd.get()) {
 
 				IF_VERBOSE (
-					printf("Handling client\n");
+					printf("Accepting client\n");
 				)
 
-				assert(epoll_events[i].data.fd != -1);
-				epoll_ctl(this->epollfd.get(), EPOLL_CTL_DEL, epoll_events[i].data.fd, NULL);
-				handle_client(std::move(RAII_FD(epoll_events[i].data.fd)), &buffer);
+				if (this->tls) {
+					this->accept_tls_client();
+				} else {
+					int clientfd = this->accept_client(this->serverfd.get(), 0);
+					if (clientfd != -1 && add_client(this->epollfd.get(), clientfd, &epoll_ev)) {
+						++this->open_clients;
+					}
+				}
+
+			} else if (fd == this->unixfd.get()) {
+
+				// Co-located clients, TLS would only add cost
+				int clientfd = this->accept_client(this->unixfd.get(), 0);
+				if (clientfd != -1 && add_client(this->epollfd.get(), clientfd, &epoll_ev)) {
+					++this->open_clients;
+				}
+
+			} else if (fd == this->sweepfd.get()) {
+
+				this->sweep();
+
+			} else if (fd == this->shmfd.get()) {
+
+				this->attach_session();
+
+			} else if (fd == this->signalfd.get()) {
 
+				this->handle_signals();
+
+			} else if (fd == this->handoffd.get()) {
+
+				this->send_handoff();
+
+			} else if (fd == this->shutdownfd.get()) {
+
+				// Handled once the batch is done
+
+			}
+		}
+
+		if (!this->shutting_down) {
+			continue;
+		}
+
+		if (timeout == -1) {
+			// shutdownfd is never read so it keeps waking listeners until all of them have seen it
+			timeout = Service_Constants::DRAIN_POLL_MS;
+			if (++this->draining_listeners == this->num_listeners) {
+				epoll_ctl(this->epollfd.get(), EPOLL_CTL_DEL, this->shutdownfd.get(), NULL);
 			}
 		}
+
+		if (this->open_clients == 0 || this->drain_expired()) {
+			IF_VERBOSE (
+				printf("Listener stopped\n");
+			)
+			return;
+		}
 	}
 }
\ No newline at end of file
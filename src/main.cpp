@@ -1,6 +1,12 @@
 #include <service.h>
 
 int main() {
-    Service service;
+    Service_Config config;
+    config.handoff_path = runtime_path(Service_Constants::DEFAULT_HANDOFF_NAME);
+    config.numa_aware = true;
+    config.unix_path = runtime_path(Service_Constants::DEFAULT_UNIX_NAME);
+    config.shm_path = runtime_path(Service_Constants::DEFAULT_SHM_NAME);
+
+    Service service(config);
     service.start();
 }
\ No newline at end of file
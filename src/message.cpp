@@ -0,0 +1,37 @@
+#include <message.h>
+#include <request-code.h>
+#include <wire-format.h>
+
+Status_Code check_header(const Header& h) {
+
+	if (h.magic_number != Message_Constants::MAGIC_NUMBER) {
+		return Status_Code::UNKNOWN_ERROR;
+	}
+
+	if (h.code < 1 or h.code > 4) {
+		return Status_Code::UNSUPPORTED_TYPE;
+	}
+
+	if (h.payload_length > Message_Constants::PAYLOAD_SIZE) {
+		return Status_Code::TOO_LARGE;
+	}
+
+	// Only COMPRESS carries a payload
+	if (h.payload_length > 0 && h.code != static_cast<uint16_t>(Request_Code::COMPRESS)) {
+		return Status_Code::UNSUPPORTED_TYPE;
+	}
+
+	return Status_Code::OK;
+}
+
+Frame parse_frame(const uint8_t* buffer) {
+
+	Frame frame;
+	frame.header = Wire_Format::decode_header(buffer);
+	frame.status = check_header(frame.header);
+	// A rejected length is still counted as received, up to what the buffer can hold
+	frame.size = Message_Constants::HEADER_SIZE +
+				 std::min<std::size_t>(frame.header.payload_length, Message_Constants::PAYLOAD_SIZE);
+
+	return frame;
+}
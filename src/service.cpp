@@ -1,20 +1,142 @@
 #include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
 #include <service.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+Service::Service() : Service(Service_Config{}) {}
+
+// Errors that concern the connection being accepted or a passing shortage rather than the listening socket.
+// Linux also reports pending network errors on the new connection through accept.
+bool transient_accept_error(int error) {
+	switch (error) {
+		case EAGAIN:
+		case EINTR:
+		case ECONNABORTED:
+		case EPROTO:
+		case EPERM:
+		case ENOBUFS:
+		case ENOMEM:
+		case ENETDOWN:
+		case ENOPROTOOPT:
+		case EHOSTDOWN:
+		case ENONET:
+		case EHOSTUNREACH:
+		case EOPNOTSUPP:
+		case ENETUNREACH:
+			return true;
+		default:
+			return false;
+	}
+}
 
-Service::Service() : Service(Service_Constants::DEFAULT_NUM_LISTENERS, 
-							 Service_Constants::DEFAULT_NUM_WORKERS, 
-							 Service_Constants::DEFAULT_PORT,
-							 Service_Constants::DEFAULT_BACKLOG_SIZE) {}
+Service_Config sized_config(std::size_t num_listeners, std::size_t num_workers, uint16_t port, int backlog_size) {
+
+	Service_Config config;
+	config.num_listeners = num_listeners;
+	config.num_workers = num_workers;
+	config.port = port;
+	config.backlog_size = backlog_size;
+
+	return config;
+}
 
 Service::Service(std::size_t num_listeners, std::size_t num_workers, uint16_t port, int backlog_size):
-	port(port), backlog_size(backlog_size), num_listeners(num_listeners), num_workers(num_workers) {
+	Service(sized_config(num_listeners, num_workers, port, backlog_size)) {}
+
+Service::Service(const Service_Config& config):
+	port(config.port), backlog_size(config.backlog_size), 
+	num_listeners(config.num_listeners), num_workers(config.num_workers),
+	handoff_path(config.handoff_path), unix_path(config.unix_path), shm_path(config.shm_path),
+	numa_aware(config.numa_aware) {
+
+	std::vector<Topology::Node> nodes = this->numa_aware ? Topology::discover() : std::vector<Topology::Node>{{0, {}}};
+
+	// Every group needs at least one listener and one worker
+	std::size_t num_groups = std::max<std::size_t>(1, std::min({nodes.size(), this->num_listeners, this->num_workers}));
+	for (std::size_t i = 0; i < num_groups; i++) {
+		this->groups.push_back(std::make_unique<Worker_Group>());
+		this->groups.back()->node = nodes[i];
+	}
+
+	// Held so accept_client can free a descriptor to shed connections when the process runs out
+	this->reservefd = RAII_FD(open("/dev/null", O_RDONLY | O_CLOEXEC));
+
+	// Block termination signals before any thread is spawned so they are only seen through signalfd
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	if (pthread_sigmask(SIG_BLOCK, &mask, nullptr)) {
+		throw std::runtime_error("Signal mask failed");
+	}
+
+	int signalfd_raw = ::signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signalfd_raw == -1) {
+		throw std::runtime_error("Signalfd create failed");
+	}
+	this->signalfd = RAII_FD(signalfd_raw);
+
+	int shutdownfd_raw = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (shutdownfd_raw == -1) {
+		throw std::runtime_error("Eventfd create failed");
+	}
+	this->shutdownfd = RAII_FD(shutdownfd_raw);
+
+	if (!config.tls_certificate.empty() || !config.tls_private_key.empty()) {
+		this->tls = std::make_unique<Tls::Context>(config.tls_certificate, config.tls_private_key);
+	}
+
+	if (this->receive_handoff()) {
+		auto [serverfd_temp, addr] = this->create_server_socket();
+		this->serverfd = std::move(serverfd_temp);
+		this->addr = addr;
+	} else {
+		this->addr = {};
+	}
+
+	// Sockets handed over are still bound to their paths, only create the ones that are missing
+	if (this->unix_path.empty()) {
+		this->unixfd = RAII_FD();
+	} else if (this->unixfd.get() == -1) {
+		this->unixfd = this->create_unix_socket(this->unix_path, this->backlog_size);
+	}
 
-	auto [serverfd_temp, addr] = this->create_server_socket();
-	this->serverfd = std::move(serverfd_temp);
-	this->addr = addr;
+	if (this->shm_path.empty()) {
+		this->shmfd = RAII_FD();
+	} else if (this->shmfd.get() == -1) {
+		this->shmfd = this->create_unix_socket(this->shm_path, this->backlog_size);
+	}
+
+	if (!this->handoff_path.empty()) {
+		this->handoffd = this->create_unix_socket(this->handoff_path, 1);
+	}
+
+	// Handshakes and shared-memory attaches wait on the client, the timer bounds how long
+	if (this->tls || this->shmfd.get() != -1) {
+		int sweepfd_raw = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (sweepfd_raw == -1) {
+			throw std::runtime_error("Timerfd create failed");
+		}
+		this->sweepfd = RAII_FD(sweepfd_raw);
+
+		struct timespec interval = {std::chrono::seconds(Service_Constants::SWEEP_INTERVAL).count(), 0};
+		struct itimerspec sweep = {interval, interval};
+		if (timerfd_settime(this->sweepfd.get(), 0, &sweep, nullptr) == -1) {
+			throw std::runtime_error("Timerfd set failed");
+		}
+	}
 
 	int epollfd_raw = epoll_create(1);
 	if (epollfd_raw == -1) {
@@ -23,48 +145,187 @@ Service::Service(std::size_t num_listeners, std::size_t num_workers, uint16_t po
 	}
 	this->epollfd = RAII_FD(epollfd_raw);
 
+	this->watch(this->serverfd.get(), EPOLLIN | EPOLLEXCLUSIVE);
+	if (this->unixfd.get() != -1) {
+		this->watch(this->unixfd.get(), EPOLLIN | EPOLLEXCLUSIVE);
+	}
+	if (this->shmfd.get() != -1) {
+		this->watch(this->shmfd.get(), EPOLLIN | EPOLLEXCLUSIVE);
+	}
+	// Every listener has to observe shutdown, so these wake all waiters
+	this->watch(this->signalfd.get(), EPOLLIN);
+	this->watch(this->shutdownfd.get(), EPOLLIN);
+	if (this->handoffd.get() != -1) {
+		this->watch(this->handoffd.get(), EPOLLIN | EPOLLEXCLUSIVE);
+	}
+	// Stays watched while draining, handshakes still count as open clients
+	if (this->sweepfd.get() != -1) {
+		this->watch(this->sweepfd.get(), EPOLLIN | EPOLLEXCLUSIVE);
+	}
+
+	// Everything that can fail is done, the previous instance may stop now
+	this->acknowledge_handoff();
+
+}
+
+void Service::watch(int fd, uint32_t events, Watch::Kind kind) {
+
 	epoll_event epoll_ev;
-	epoll_ev.events = EPOLLIN | EPOLLEXCLUSIVE;
-	epoll_ev.data.fd = this->serverfd.get();
+	epoll_ev.events = events;
+	epoll_ev.data.u64 = Watch::tag(kind, fd);
 
-	if (epoll_ctl(epollfd_raw, EPOLL_CTL_ADD, serverfd.get(), &epoll_ev)) {
-		throw std::runtime_error("Epoll CTL: listener socket failed");
+	if (epoll_ctl(this->epollfd.get(), EPOLL_CTL_ADD, fd, &epoll_ev)) {
+		throw std::runtime_error("Epoll CTL: service socket failed");
 	}
 
 }
 
+bool Service::rearm(int fd, uint32_t events, Watch::Kind kind) {
+
+	epoll_event epoll_ev;
+	epoll_ev.events = events;
+	epoll_ev.data.u64 = Watch::tag(kind, fd);
+
+	return epoll_ctl(this->epollfd.get(), EPOLL_CTL_MOD, fd, &epoll_ev) != 0;
+}
+
 void Service::start() {
 
 	this->listeners.reserve(num_listeners);
 	for (std::size_t i = 0; i < num_listeners; i++) {
-		this->listeners[i] = std::thread(&Service::accept_requests, this);
+		this->listeners.emplace_back(&Service::accept_requests, this, this->groups[i % this->groups.size()].get());
 	}
 
 	this->workers.reserve(num_workers);
 	for (std::size_t i = 0; i < num_workers; i++) {
-		this->workers[i] = std::thread(&Service::process_requests, this);
+		this->workers.emplace_back(&Service::process_requests, this, this->groups[i % this->groups.size()].get());
 	}
 	
-	for (std::size_t i = 0; i < num_listeners; i++) {
-		this->listeners[i].join();
+	// Listeners return once shutdown has begun and the accepted clients are drained
+	for (auto& listener: this->listeners) {
+		listener.join();
 	}
 
-	for (std::size_t i = 0; i < num_workers; i++) {
-		this->workers[i].join();
+	// Nothing can be published anymore, workers finish the queue and return
+	for (auto& group: this->groups) {
+		{
+			std::lock_guard<std::mutex> guard(group->requests_lock);
+			group->stopping = true;
+		}
+		group->waiting_workers.notify_all();
+	}
+
+	for (auto& worker: this->workers) {
+		worker.join();
 	}
 
+	IF_VERBOSE (
+		printf("Service stopped\n");
+	)
+
 }
 
-bool Service::recv_bytes(int clientfd, Service_Constants::Buffer* recv_buffer, std::size_t n) {
+void Service::pin_to(const Worker_Group& group) {
+
+	if (!this->numa_aware) {
+		return;
+	}
+
+	if (Topology::pin_current_thread(group.node.cpus)) {
+		IF_VERBOSE (
+			printf("Failed to pin thread to node %i\n", group.node.id);
+		)
+	}
+
+}
+
+void Service::begin_shutdown() {
+
+	if (this->shutting_down.exchange(true)) {
+		return;
+	}
+
+	this->drain_deadline = std::chrono::steady_clock::now() + Service_Constants::DRAIN_TIMEOUT;
+
+	IF_VERBOSE (
+		printf("Beginning shutdown\n");
+	)
+
+	// Stop accepting, pending connections stay in the backlog for a replacement process if there is one
+	for (int fd: {this->serverfd.get(), this->unixfd.get(), this->shmfd.get(), this->handoffd.get()}) {
+		if (fd != -1) {
+			epoll_ctl(this->epollfd.get(), EPOLL_CTL_DEL, fd, nullptr);
+		}
+	}
+
+	uint64_t wake = 1;
+	if (write(this->shutdownfd.get(), &wake, sizeof(wake)) == -1) {
+		throw std::runtime_error("Shutdown notification failed");
+	}
+
+}
+
+bool Service::drain_expired() const {
+	return std::chrono::steady_clock::now() >= this->drain_deadline.load();
+}
+
+bool Service::wait_readable(int clientfd) {
+
+	if (this->shutting_down) {
+
+		auto remaining = std::chrono::ceil<std::chrono::milliseconds>(this->drain_deadline.load() - std::chrono::steady_clock::now());
+		if (remaining.count() <= 0) {
+			return true;
+		}
+
+		struct pollfd client_poll = {clientfd, POLLIN, 0};
+		poll(&client_poll, 1, static_cast<int>(remaining.count()));
+		return false;
+	}
+
+	// Also wake for a signal or for another listener beginning shutdown, since this listener
+	// is not waiting on the epoll while it reads from clientfd
+	std::array<struct pollfd, 3> polls = {{
+		{clientfd, POLLIN, 0},
+		{this->signalfd.get(), POLLIN, 0},
+		{this->shutdownfd.get(), POLLIN, 0},
+	}};
+	if (poll(polls.data(), polls.size(), -1) > 0 && (polls[1].revents & POLLIN)) {
+		this->handle_signals();
+	}
+
+	return false;
+}
+
+void Service::handle_signals() {
+
+	struct signalfd_siginfo info;
+	while (read(this->signalfd.get(), &info, sizeof(info)) == sizeof(info)) {
+		IF_VERBOSE (
+			printf("Recieved signal %u\n", info.ssi_signo);
+		)
+	}
+
+	this->begin_shutdown();
+
+}
+
+bool Service::recv_bytes(int clientfd, void* destination, std::size_t n) {
 	
 	ssize_t num_bytes = 0;
 	std::size_t read_bytes = 0;
 
 	while (read_bytes < n) {
 
-		num_bytes = recv(clientfd, recv_buffer->data() + read_bytes, n - read_bytes, 0);
+		num_bytes = recv(clientfd, static_cast<uint8_t*>(destination) + read_bytes, n - read_bytes, MSG_DONTWAIT);
 
-		if (num_bytes == -1) {
+		if (num_bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (this->wait_readable(clientfd)) {
+				return true;
+			}
+			continue;
+
+		} else if (num_bytes == -1) {
 
 			this->respond_with_error(clientfd, Status_Code::UNKNOWN_ERROR);
 			return true;
@@ -91,9 +352,54 @@ bool Service::recv_bytes(int clientfd, Service_Constants::Buffer* recv_buffer, s
 	return false;
 }
 
+// Returns true unless connecting to addr is refused, a full backlog still counts as listening
+bool unix_socket_listening(const struct sockaddr_un& addr) {
+
+	RAII_FD probe(socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+	if (probe.get() == -1) {
+		throw std::runtime_error("Unix socket creation failed");
+	}
+
+	return connect(probe.get(), reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == 0 || errno != ECONNREFUSED;
+}
+
+int Service::accept_client(int listenfd, int flags) {
+
+	int clientfd = accept4(listenfd, nullptr, nullptr, flags);
+	if (clientfd != -1) {
+		return clientfd;
+	}
+
+	if (errno == EMFILE || errno == ENFILE) {
+
+		// The connection stays in the backlog and the listening socket stays readable, so without
+		// shedding it every listener would spin on it. Give up the reserve descriptor to refuse it.
+		fprintf(stderr, "Out of file descriptors, dropping a connection\n");
+
+		std::lock_guard<std::mutex> guard(this->reserve_lock);
+		this->reservefd = RAII_FD();
+		RAII_FD dropped(accept4(listenfd, nullptr, nullptr, SOCK_CLOEXEC));
+		dropped = RAII_FD();
+		this->reservefd = RAII_FD(open("/dev/null", O_RDONLY | O_CLOEXEC));
+
+		return -1;
+	}
+
+	// EAGAIN is routine, the sockets are non-blocking and shared between listeners and during a hot restart
+	if (transient_accept_error(errno)) {
+		IF_VERBOSE (
+			printf("Accept failed transiently: %s\n", strerror(errno));
+		)
+		return -1;
+	}
+
+	throw std::runtime_error("Accept connection failed");
+}
+
 std::pair<RAII_FD, struct sockaddr_in> Service::create_server_socket() {
 
-	int serverfd_raw = socket(AF_INET, SOCK_STREAM, 0);
+	// Non-blocking so a listener never stalls in accept when another listener or process won the race
+	int serverfd_raw = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
 	if (serverfd_raw == -1) {
 		throw std::runtime_error("Socket creation failed");
 	}
@@ -121,6 +427,81 @@ std::pair<RAII_FD, struct sockaddr_in> Service::create_server_socket() {
 	return std::pair<RAII_FD, struct sockaddr_in> {std::move(serverfd), addr};
 }
 
+struct sockaddr_un unix_address(const std::string& path) {
+
+	struct sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+
+	if (path.size() >= sizeof(addr.sun_path)) {
+		throw std::runtime_error("Unix socket path too long");
+	}
+	memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+	return addr;
+}
+
+std::string runtime_path(const std::string& name) {
+
+	std::string directory;
+	const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+	if (runtime_dir != nullptr && runtime_dir[0] != '\0') {
+		directory = std::string(runtime_dir) + "/" + Service_Constants::RUNTIME_DIRECTORY_NAME;
+	} else {
+		directory = std::string("/tmp/") + Service_Constants::RUNTIME_DIRECTORY_NAME + "-" + std::to_string(geteuid());
+	}
+
+	if (mkdir(directory.c_str(), S_IRWXU) == -1 && errno != EEXIST) {
+		throw std::runtime_error("Runtime directory creation failed");
+	}
+
+	// Someone else may have created it first in a shared parent such as /tmp
+	struct stat directory_stat;
+	if (lstat(directory.c_str(), &directory_stat) == -1 || !S_ISDIR(directory_stat.st_mode) ||
+			directory_stat.st_uid != geteuid() || (directory_stat.st_mode & (S_IRWXG | S_IRWXO)) != 0) {
+		throw std::runtime_error("Runtime directory is not private");
+	}
+
+	return directory + "/" + name;
+}
+
+RAII_FD Service::create_unix_socket(const std::string& path, int backlog) {
+
+	int socketfd_raw = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (socketfd_raw == -1) {
+		throw std::runtime_error("Unix socket creation failed");
+	}
+	RAII_FD socketfd(socketfd_raw);
+
+	struct sockaddr_un addr = unix_address(path);
+	struct stat info;
+	if (lstat(addr.sun_path, &info) == 0) {
+		if (!S_ISSOCK(info.st_mode)) {
+			fprintf(stderr, "%s is not a socket\n", addr.sun_path);
+			throw std::runtime_error("Unix socket path is taken");
+		}
+		// The previous owner either handed its sockets to us, is draining or is gone
+		if (!this->replacing && unix_socket_listening(addr)) {
+			fprintf(stderr, "%s is in use\n", addr.sun_path);
+			throw std::runtime_error("Unix socket path is taken");
+		}
+		if (unlink(addr.sun_path) == -1) {
+			throw std::runtime_error("Unix socket unlink failed");
+		}
+	} else if (errno != ENOENT) {
+		throw std::runtime_error("Unix socket path lstat failed");
+	}
+
+	if (bind(socketfd.get(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
+		throw std::runtime_error("Unix socket bind failed");
+	}
+
+	if (listen(socketfd.get(), backlog) == -1) {
+		throw std::runtime_error("Unix socket listen failed");
+	}
+
+	return socketfd;
+}
+
 void Service::respond_with_error(int clientfd, Status_Code error_code) {
 
 	IF_VERBOSE (
@@ -129,31 +510,19 @@ void Service::respond_with_error(int clientfd, Status_Code error_code) {
 
 	assert(clientfd != -1);
 
-	Header h;
-	h.payload_length = 0;
-    h.code = static_cast<uint16_t>(error_code);
-	h.set_net_order();
+	auto code = static_cast<std::size_t>(error_code);
+	assert(code < Canned_Responses::STATUS.size());
 
-	Network_Order_Message net_msg(h);
-	this->respond(clientfd, net_msg);
+	const auto& response = Canned_Responses::STATUS[code];
+	this->send_bytes(clientfd, response.data(), response.size());
 	
 }
 
-void Service::respond(int clientfd, const Network_Order_Message& msg) {
+void Service::respond(int clientfd, const Message& msg) {
 
 	assert(clientfd != -1);
 
-	std::array<uint8_t, Message_Constants::HEADER_SIZE> write_buffer;
-
-	uint8_t* write_head = write_buffer.data();
-
-	memcpy(write_head, &msg.header.magic_number, sizeof(msg.header.magic_number));
-	write_head += sizeof(msg.header.magic_number);
-
-	memcpy(write_head, &msg.header.payload_length, sizeof(msg.header.payload_length));
-	write_head += sizeof(msg.header.payload_length);
-
-	memcpy(write_head, &msg.header.code, sizeof(msg.header.code));
+	const auto write_buffer = Wire_Format::encode_header(msg.header);
 
 	IF_VERBOSE (
 		printf("Responding to client %u\n", clientfd);
@@ -169,45 +538,67 @@ void Service::respond(int clientfd, const Network_Order_Message& msg) {
 		fprintf(stdout, "\n");
 	)
 
-	ssize_t num_bytes = 0;
-	ssize_t bytes_sent = 0;
-	do {
-		num_bytes = send(clientfd, write_buffer.data() + bytes_sent, Message_Constants::HEADER_SIZE - bytes_sent, 0);
+	// Hold the header back until the payload is queued so both leave in one segment
+	int header_flags = msg.payload.empty() ? 0 : MSG_MORE;
+	if (this->send_bytes(clientfd, write_buffer.data(), write_buffer.size(), header_flags)) {
+		return;
+	}
 
-		if (num_bytes == -1) {
-			// Write error, abandon client
-			IF_VERBOSE (
-				printf("Error sending header\n");
-			)
-			return;
-		}
+	this->send_bytes(clientfd, reinterpret_cast<const uint8_t*>(msg.payload.data()), msg.payload.size());
 
-		bytes_sent += num_bytes;
+}
 
-		this->stats_lock.lock();
-		this->total_bytes_sent += num_bytes;
-		this->stats_lock.unlock();
+void Service::reply(const Job& job, const uint8_t* frame, std::size_t n) {
 
-	} while (bytes_sent < Message_Constants::HEADER_SIZE);
-	
-	bytes_sent = 0;
-	do {
-		num_bytes = send(clientfd, msg.payload.data() + bytes_sent, msg.payload.size() - bytes_sent, 0);
+	if (job.slot != nullptr) {
+		assert(n >= Message_Constants::HEADER_SIZE);
+		this->complete_slot(job.session.get(), job.slot, frame, 
+			reinterpret_cast<const char*>(frame + Message_Constants::HEADER_SIZE), n - Message_Constants::HEADER_SIZE);
+		return;
+	}
+
+	this->send_bytes(job.clientfd.get(), frame, n);
+
+}
+
+void Service::reply(const Job& job, const Message& msg) {
+
+	if (job.slot != nullptr) {
+		const auto header = Wire_Format::encode_header(msg.header);
+		this->complete_slot(job.session.get(), job.slot, header.data(), msg.payload.data(), msg.payload.size());
+		return;
+	}
+
+	this->respond(job.clientfd.get(), msg);
+
+}
+
+bool Service::send_bytes(int clientfd, const uint8_t* bytes, std::size_t n, int flags) {
+
+	assert(clientfd != -1);
+
+	ssize_t num_bytes = 0;
+	std::size_t bytes_sent = 0;
+
+	while (bytes_sent < n) {
+
+		num_bytes = send(clientfd, bytes + bytes_sent, n - bytes_sent, flags);
 
 		if (num_bytes == -1) {
 			// Write error, abandon client
 			IF_VERBOSE (
-				printf("Error sending payload\n");
+				printf("Error sending response\n");
 			)
-			return;
-		} 
+			return true;
+		}
 
 		bytes_sent += num_bytes;
 
 		this->stats_lock.lock();
 		this->total_bytes_sent += num_bytes;
 		this->stats_lock.unlock();
-		
-	} while (bytes_sent < msg.payload.size());
 
+	}
+
+	return false;
 }
\ No newline at end of file
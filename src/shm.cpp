@@ -0,0 +1,280 @@
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <request-code.h>
+#include <service.h>
+#include <sys/stat.h>
+
+Shm_Ring::Ring* map_ring(int memfd) {
+
+	// Checked before the size, which the seals then keep from changing
+	int seals = fcntl(memfd, F_GET_SEALS);
+	if (seals == -1 || (seals & Shm_Ring::REQUIRED_SEALS) != Shm_Ring::REQUIRED_SEALS) {
+		return nullptr;
+	}
+
+	struct stat memfd_stat;
+	if (fstat(memfd, &memfd_stat) == -1 || static_cast<std::size_t>(memfd_stat.st_size) < Shm_Ring::RING_SIZE) {
+		return nullptr;
+	}
+
+	void* region = mmap(nullptr, Shm_Ring::RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (region == MAP_FAILED) {
+		return nullptr;
+	}
+
+	auto ring = static_cast<Shm_Ring::Ring*>(region);
+	if (ring->magic_number != Shm_Ring::MAGIC_NUMBER || ring->num_slots != Shm_Ring::NUM_SLOTS) {
+		munmap(region, Shm_Ring::RING_SIZE);
+		return nullptr;
+	}
+
+	return ring;
+}
+
+// Adds O_NONBLOCK to fd's status flags, keeping the ones the client set. Returns 0 on success
+bool set_nonblocking(int fd) {
+
+	int flags = fcntl(fd, F_GETFL);
+	return flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1;
+}
+
+void Service::attach_session() {
+
+	// Non-blocking, the ring is received once it arrives rather than waited for on the listener
+	int controlfd_raw = this->accept_client(this->shmfd.get(), SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (controlfd_raw == -1) {
+		return;
+	}
+
+	auto session = std::make_shared<Shm_Session>();
+	session->controlfd = RAII_FD(controlfd_raw);
+	session->deadline = std::chrono::steady_clock::now() + Service_Constants::ATTACH_TIMEOUT;
+
+	{
+		std::unique_lock<std::shared_mutex> guard(this->sessions_lock);
+		this->sessions[controlfd_raw] = session;
+	}
+
+	// One-shot so a single listener finishes the attach
+	this->watch(controlfd_raw, EPOLLIN | EPOLLONESHOT, Watch::Kind::SHM_CONTROL);
+
+}
+
+void Service::finish_attach(const std::shared_ptr<Shm_Session>& session) {
+
+	int controlfd = session->controlfd.get();
+
+	char data = 0;
+	struct iovec iov = {&data, sizeof(data)};
+
+	alignas(struct cmsghdr) char control[CMSG_SPACE(Shm_Ring::NUM_ATTACH_FDS * sizeof(int))];
+	struct msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t num_bytes = recvmsg(controlfd, &msg, MSG_CMSG_CLOEXEC);
+	if (num_bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		this->rearm(controlfd, EPOLLIN | EPOLLONESHOT, Watch::Kind::SHM_CONTROL);
+		return;
+	}
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if (num_bytes <= 0 || cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		this->detach_session(controlfd);
+		return;
+	}
+
+	std::array<int, Shm_Ring::NUM_ATTACH_FDS> fds;
+	std::size_t num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	memcpy(fds.data(), CMSG_DATA(cmsg), std::min(num_fds, fds.size()) * sizeof(int));
+
+	// Take ownership first so every received fd is closed on failure
+	RAII_FD memfd(num_fds > 0 ? fds[0] : -1);
+	RAII_FD request_doorbell(num_fds > 1 ? fds[1] : -1);
+	RAII_FD response_doorbell(num_fds > 2 ? fds[2] : -1);
+
+	Shm_Ring::Ring* ring = nullptr;
+	Status_Code status = Status_Code::OK;
+	if (num_fds != Shm_Ring::NUM_ATTACH_FDS) {
+		status = Status_Code::UNKNOWN_ERROR;
+	} else if ((ring = map_ring(memfd.get())) == nullptr) {
+		status = Status_Code::UNKNOWN_ERROR;
+	} else if (set_nonblocking(request_doorbell.get()) || set_nonblocking(response_doorbell.get())) {
+		// A full response counter must never block a worker
+		status = Status_Code::UNKNOWN_ERROR;
+	}
+
+	if (ring != nullptr) {
+		session->ring = ring;
+		session->request_doorbell = std::move(request_doorbell);
+		session->response_doorbell = std::move(response_doorbell);
+	}
+
+	if (status == Status_Code::OK) {
+
+		int doorbell = session->request_doorbell.get();
+		{
+			std::unique_lock<std::shared_mutex> guard(this->sessions_lock);
+			// Dropped by expire_attaches while the ring was being checked
+			if (this->sessions.count(controlfd) == 0) {
+				return;
+			}
+			session->attached = true;
+			this->sessions[doorbell] = session;
+		}
+
+		// The doorbell comes from the client, so it may be something epoll refuses
+		epoll_event epoll_ev;
+		epoll_ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+		epoll_ev.data.u64 = Watch::tag(Watch::Kind::SHM_DOORBELL, doorbell);
+		if (epoll_ctl(this->epollfd.get(), EPOLL_CTL_ADD, doorbell, &epoll_ev) == -1) {
+			status = Status_Code::UNKNOWN_ERROR;
+		}
+	}
+
+	auto reply = static_cast<char>(status);
+	if (send(controlfd, &reply, sizeof(reply), MSG_NOSIGNAL) != sizeof(reply) || status != Status_Code::OK) {
+		this->detach_session(controlfd);
+		return;
+	}
+
+	// From here on the control socket only becomes readable when the client goes away
+	this->rearm(controlfd, EPOLLIN | EPOLLONESHOT, Watch::Kind::SHM_CONTROL);
+
+	IF_VERBOSE (
+		printf("Attached shared memory session %i\n", controlfd);
+	)
+
+}
+
+void Service::expire_attaches() {
+
+	auto now = std::chrono::steady_clock::now();
+	std::vector<int> expired;
+	{
+		std::shared_lock<std::shared_mutex> guard(this->sessions_lock);
+		for (const auto& [fd, session]: this->sessions) {
+			if (!session->attached && session->deadline <= now) {
+				expired.push_back(fd);
+			}
+		}
+	}
+
+	for (int controlfd: expired) {
+		IF_VERBOSE (
+			printf("Shared memory attach timed out\n");
+		)
+		this->detach_session(controlfd);
+	}
+
+}
+
+std::shared_ptr<Shm_Session> Service::find_session(int fd) {
+
+	std::shared_lock<std::shared_mutex> guard(this->sessions_lock);
+	auto it = this->sessions.find(fd);
+
+	return it == this->sessions.end() ? nullptr : it->second;
+}
+
+void Service::detach_session(int fd) {
+
+	std::shared_ptr<Shm_Session> session;
+	{
+		std::unique_lock<std::shared_mutex> guard(this->sessions_lock);
+		auto it = this->sessions.find(fd);
+		if (it == this->sessions.end()) {
+			return;
+		}
+		session = it->second;
+		this->sessions.erase(session->request_doorbell.get());
+		this->sessions.erase(session->controlfd.get());
+	}
+
+	// The doorbell is not registered yet if the session never finished attaching
+	if (session->request_doorbell.get() != -1) {
+		epoll_ctl(this->epollfd.get(), EPOLL_CTL_DEL, session->request_doorbell.get(), nullptr);
+	}
+	epoll_ctl(this->epollfd.get(), EPOLL_CTL_DEL, session->controlfd.get(), nullptr);
+
+	IF_VERBOSE (
+		printf("Detached shared memory session %i\n", session->controlfd.get());
+	)
+
+}
+
+void Service::handle_doorbell(const std::shared_ptr<Shm_Session>& session, Worker_Group* group) {
+
+	// Reset the doorbell before scanning, a request published after this rings it again
+	uint64_t rings = 0;
+	if (read(session->request_doorbell.get(), &rings, sizeof(rings)) == -1 && errno != EAGAIN) {
+		this->detach_session(session->controlfd.get());
+		return;
+	}
+
+	for (Shm_Ring::Slot& slot: session->ring->slots) {
+
+		auto expected = static_cast<uint32_t>(Shm_Ring::Slot_State::REQUEST);
+		if (!slot.state.compare_exchange_strong(expected, static_cast<uint32_t>(Shm_Ring::Slot_State::BUSY),
+				std::memory_order_acquire, std::memory_order_relaxed)) {
+			continue;
+		}
+
+		Frame frame = parse_frame(slot.frame);
+		const Header& h = frame.header;
+
+		this->stats_lock.lock();
+		this->total_bytes_recieved += frame.size;
+		this->stats_lock.unlock();
+
+		if (frame.status != Status_Code::OK) {
+			const auto& response = Canned_Responses::STATUS[static_cast<std::size_t>(frame.status)];
+			this->complete_slot(session.get(), &slot, response.data(), nullptr, 0);
+			continue;
+		}
+
+		if (h.code == static_cast<uint16_t>(Request_Code::PING)) {
+			this->complete_slot(session.get(), &slot, Canned_Responses::OK.data(), nullptr, 0);
+			continue;
+		}
+
+		// The worker compresses straight out of the slot
+		Request request(h);
+		request.payload = Pooled_Payload(reinterpret_cast<char*>(slot.frame + Message_Constants::HEADER_SIZE), h.payload_length);
+
+		Job job(std::move(request), session, &slot);
+		this->publish_job(std::move(job), group);
+	}
+
+}
+
+void Service::complete_slot(Shm_Session* session, Shm_Ring::Slot* slot,
+							const uint8_t* header, const char* payload, std::size_t payload_size) {
+
+	assert(payload_size <= Message_Constants::PAYLOAD_SIZE);
+
+	memcpy(slot->frame, header, Message_Constants::HEADER_SIZE);
+	if (payload_size > 0) {
+		memmove(slot->frame + Message_Constants::HEADER_SIZE, payload, payload_size);
+	}
+
+	slot->state.store(static_cast<uint32_t>(Shm_Ring::Slot_State::RESPONSE), std::memory_order_release);
+
+	uint64_t ring = 1;
+	if (write(session->response_doorbell.get(), &ring, sizeof(ring)) == -1) {
+		// EAGAIN means the client filled the counter without ever reading it
+		IF_VERBOSE (
+			printf("Failed to ring response doorbell\n");
+		)
+		this->detach_session(session->controlfd.get());
+	}
+
+	this->stats_lock.lock();
+	this->total_bytes_sent += Message_Constants::HEADER_SIZE + payload_size;
+	this->stats_lock.unlock();
+
+}
@@ -0,0 +1,145 @@
+#include <cerrno>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <tls.h>
+#include <unistd.h>
+
+#ifdef TLS
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#if OPENSSL_VERSION_NUMBER < 0x30000000L
+#error "Kernel TLS offload needs SSL_OP_ENABLE_KTLS, which first appeared in OpenSSL 3.0"
+#endif
+
+// Without it SSL_OP_ENABLE_KTLS is accepted and ignored, and every handshake would end in a dropped connection
+#ifdef OPENSSL_NO_KTLS
+#error "OpenSSL was built without kernel TLS support (OPENSSL_NO_KTLS), rebuild it with enable-ktls"
+#endif
+
+// Cipher suites the kernel can take over
+static constexpr const char* KTLS_CIPHERSUITES = 
+	"TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256";
+static constexpr const char* KTLS_CIPHER_LIST = 
+	"ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:"
+	"ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:"
+	"ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305";
+
+// Setting the ULP on an unconnected socket loads the module and then fails with ENOTCONN, ENOENT means no kTLS
+bool ktls_available() {
+
+	int probefd = socket(AF_INET, SOCK_STREAM, 0);
+	if (probefd == -1) {
+		return false;
+	}
+
+	bool available = setsockopt(probefd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0 || errno != ENOENT;
+	close(probefd);
+
+	return available;
+}
+
+Tls::Context::Context(const std::string& certificate_path, const std::string& private_key_path) {
+
+	if (!ktls_available()) {
+		throw std::runtime_error("Kernel TLS is not available, load the tls module");
+	}
+
+	this->ctx = SSL_CTX_new(TLS_server_method());
+	if (this->ctx == nullptr) {
+		throw std::runtime_error("TLS context creation failed");
+	}
+
+	SSL_CTX_set_min_proto_version(this->ctx, TLS1_2_VERSION);
+#if OPENSSL_VERSION_NUMBER < 0x30200000L
+	// OpenSSL 3.0 and 3.1 only offload TLS 1.3 in the send direction, so every TLS 1.3 session would be dropped
+	SSL_CTX_set_max_proto_version(this->ctx, TLS1_2_VERSION);
+#endif
+	// The SSL object is freed after the handshake, so there is nothing to resume from
+	SSL_CTX_set_options(this->ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_TICKET);
+	SSL_CTX_set_num_tickets(this->ctx, 0);
+	SSL_CTX_set_session_cache_mode(this->ctx, SSL_SESS_CACHE_OFF);
+
+	if (SSL_CTX_set_ciphersuites(this->ctx, KTLS_CIPHERSUITES) != 1 ||
+		SSL_CTX_set_cipher_list(this->ctx, KTLS_CIPHER_LIST) != 1) {
+		SSL_CTX_free(this->ctx);
+		throw std::runtime_error("TLS cipher configuration failed");
+	}
+
+	if (SSL_CTX_use_certificate_chain_file(this->ctx, certificate_path.c_str()) != 1 ||
+		SSL_CTX_use_PrivateKey_file(this->ctx, private_key_path.c_str(), SSL_FILETYPE_PEM) != 1 ||
+		SSL_CTX_check_private_key(this->ctx) != 1) {
+		SSL_CTX_free(this->ctx);
+		throw std::runtime_error("TLS certificate or private key invalid");
+	}
+
+}
+
+Tls::Context::~Context() {
+	SSL_CTX_free(this->ctx);
+}
+
+Tls::Handshake::Handshake(const Context& context, int clientfd):
+	deadline(std::chrono::steady_clock::now() + Tls::HANDSHAKE_TIMEOUT), ssl(SSL_new(context.ctx)) {
+
+	// The socket BIO does not own clientfd, freeing ssl leaves it open with the kernel doing the crypto
+	if (this->ssl != nullptr) {
+		SSL_set_fd(this->ssl, clientfd);
+	}
+
+}
+
+Tls::Handshake::~Handshake() {
+	SSL_free(this->ssl);
+}
+
+Tls::Progress Tls::Handshake::advance() {
+
+	if (this->ssl == nullptr) {
+		return Progress::FAILED;
+	}
+
+	int result = SSL_accept(this->ssl);
+	if (result != 1) {
+		switch (SSL_get_error(this->ssl, result)) {
+			case SSL_ERROR_WANT_READ:
+				return Progress::WANT_READ;
+			case SSL_ERROR_WANT_WRITE:
+				return Progress::WANT_WRITE;
+			default:
+				ERR_clear_error();
+				return Progress::FAILED;
+		}
+	}
+
+	// Both directions must be in the kernel and nothing may be left buffered in userspace
+	if (!BIO_get_ktls_send(SSL_get_wbio(this->ssl)) ||
+		!BIO_get_ktls_recv(SSL_get_rbio(this->ssl)) ||
+		SSL_has_pending(this->ssl)) {
+		return Progress::FAILED;
+	}
+
+	return Progress::DONE;
+}
+
+#else
+
+Tls::Context::Context(const std::string& /*unused*/, const std::string& /*unused*/) {
+	throw std::runtime_error("Service was built without TLS support, configure with -DTLS=ON");
+}
+
+Tls::Context::~Context() = default;
+
+Tls::Handshake::Handshake(const Context& /*unused*/, int /*unused*/):
+	deadline(std::chrono::steady_clock::now()) {}
+
+Tls::Handshake::~Handshake() = default;
+
+Tls::Progress Tls::Handshake::advance() {
+	return Progress::FAILED;
+}
+
+#endif // TLS
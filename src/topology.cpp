@@ -0,0 +1,84 @@
+#include <fstream>
+#include <pthread.h>
+#include <sched.h>
+#include <sstream>
+#include <topology.h>
+
+std::string read_first_line(const std::string& path) {
+
+	std::ifstream file(path);
+	std::string line;
+	std::getline(file, line);
+
+	return line;
+}
+
+std::vector<int> Topology::parse_list(const std::string& list) {
+
+	std::vector<int> values;
+	std::stringstream ranges(list);
+	std::string range;
+
+	while (std::getline(ranges, range, ',')) {
+
+		if (range.empty()) {
+			continue;
+		}
+
+		std::size_t dash = range.find('-');
+		int first = std::stoi(range.substr(0, dash));
+		int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+
+		for (int value = first; value <= last; value++) {
+			values.push_back(value);
+		}
+	}
+
+	return values;
+}
+
+std::vector<Topology::Node> Topology::discover() {
+
+	std::vector<Node> nodes;
+
+	try {
+
+		std::string root(Topology::NODE_ROOT);
+		for (int id: parse_list(read_first_line(root + "online"))) {
+
+			std::vector<int> cpus = parse_list(read_first_line(root + "node" + std::to_string(id) + "/cpulist"));
+
+			// Memory-only nodes get no threads
+			if (!cpus.empty()) {
+				nodes.push_back(Node{id, std::move(cpus)});
+			}
+		}
+
+	} catch (const std::logic_error&) {
+		// Malformed list, treat the machine as a single node
+		nodes.clear();
+	}
+
+	if (nodes.empty()) {
+		nodes.push_back(Node{0, {}});
+	}
+
+	return nodes;
+}
+
+bool Topology::pin_current_thread(const std::vector<int>& cpus) {
+
+	if (cpus.empty()) {
+		return false;
+	}
+
+	cpu_set_t cpu_set;
+	CPU_ZERO(&cpu_set);
+	for (int cpu: cpus) {
+		if (cpu < CPU_SETSIZE) {
+			CPU_SET(cpu, &cpu_set);
+		}
+	}
+
+	return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) != 0;
+}
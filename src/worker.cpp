@@ -1,25 +1,21 @@
 #include <cassert>
+#include <cstdio>
+#include <cstdlib>
 #include <compression.h>
-#include <helpers.h>
 #include <mutex>
 #include <optional>
 #include <request-code.h>
 #include <service.h>
+#include <wire-format.h>
 
-void Service::ping(const Job& job) {
+void Service::ping(int clientfd) {
 
     IF_VERBOSE (
         printf("Ping response\n");
     )
 
-    Header h;
-    h.payload_length = 0;
-    h.code = static_cast<uint16_t>(Status_Code::OK);
-    h.set_net_order();
-
-    Network_Order_Message net_msg(h);
-    assert(job.clientfd.get() != -1);
-    this->respond(job.clientfd.get(), net_msg);
+    assert(clientfd != -1);
+    this->send_bytes(clientfd, Canned_Responses::OK.data(), Canned_Responses::OK.size());
 
 }
 
@@ -29,24 +25,21 @@ void Service::get_stats(const Job& job) {
         printf("Get_Stats response\n");
     )
 
-    Header h;
-    h.payload_length = Service_Constants::GET_STATS_PAYLOAD_SIZE;
-    h.code = static_cast<uint16_t>(Status_Code::OK);
-    h.set_net_order();
+    static constexpr auto RESPONSE_TEMPLATE =
+        Wire_Format::frame_template<Wire_Format::Stats_Layout>(static_cast<uint16_t>(Status_Code::OK));
 
-    Network_Order_Message net_msg(h);
+    auto response = RESPONSE_TEMPLATE;
 
     this->stats_lock.lock();
-    uint32_t nbo_total_bytes_recieved = htonl(this->total_bytes_recieved);
-    uint32_t nbo_total_bytes_sent = htonl(this->total_bytes_sent);
-    uint8_t nbo_compression_ratio = this->compression_ratio;
+    uint32_t total_bytes_recieved = this->total_bytes_recieved;
+    uint32_t total_bytes_sent = this->total_bytes_sent;
+    uint8_t compression_ratio = this->compression_ratio;
     this->stats_lock.unlock();
 
-    Helpers::add_bytes_to_payload(&nbo_total_bytes_recieved, &net_msg.payload);
-    Helpers::add_bytes_to_payload(&nbo_total_bytes_sent, &net_msg.payload);
-    Helpers::add_bytes_to_payload(&nbo_compression_ratio, &net_msg.payload);
+    Wire_Format::Stats_Layout::encode(response.data() + Wire_Format::Header_Layout::SIZE,
+                                      total_bytes_recieved, total_bytes_sent, compression_ratio);
 
-    this->respond(job.clientfd.get(), net_msg);
+    this->reply(job, response.data(), response.size());
 
 }
 
@@ -56,19 +49,13 @@ void Service::reset_stats(const Job& job) {
         printf("Reset_Stats response\n");
     )
 
-    Header h;
-    h.payload_length = 0;
-    h.code = static_cast<uint16_t>(Status_Code::OK);
-    h.set_net_order();
-
     this->stats_lock.lock();
     this->total_bytes_recieved = 0;
     this->total_bytes_sent = 0;
     this->compression_ratio = 0;
     this->stats_lock.unlock();
 
-    Network_Order_Message net_msg(h);
-    this->respond(job.clientfd.get(), net_msg);
+    this->reply(job, Canned_Responses::OK.data(), Canned_Responses::OK.size());
 
 }
 
@@ -78,55 +65,86 @@ void Service::compress(const Job& job) {
         printf("Compress response\n");
     )
 
-    auto payload_opt = Compression::compress(job.msg.payload);  
+    const Pooled_Payload& input = job.request.payload;
+    const char* data = input.data();
+
+    IF_DIFFERENTIAL_CHECK (
+        // A shared-memory client can rewrite its slot mid-job, so both encoders have to read one copy
+        std::vector<char> snapshot(input.data(), input.data() + input.size());
+        data = snapshot.data();
+    )
+
+    auto payload_opt = Compression::compress(data, input.size());
+
+    IF_DIFFERENTIAL_CHECK (
+        if (payload_opt != Compression::Reference::compress(snapshot)) {
+            fprintf(stderr, "Compression output differs from reference for input:\n");
+            fwrite(snapshot.data(), 1, snapshot.size(), stderr);
+            fprintf(stderr, "\n");
+            abort();
+        }
+    )
 
     if (!payload_opt.has_value()) {
-        this->respond_with_error(job.clientfd.get(), Status_Code::UNKNOWN_ERROR);
+        const auto& response = Canned_Responses::STATUS[static_cast<std::size_t>(Status_Code::UNKNOWN_ERROR)];
+        this->reply(job, response.data(), response.size());
         return;
     }
 
-    std::vector<char> payload = payload_opt.value();
+    std::vector<char> payload = std::move(payload_opt.value());
 
-    this->stats_lock.lock();
-    this->compression_ratio = payload.size() / job.msg.payload.size();
-    this->stats_lock.unlock();
+    // An empty COMPRESS request is valid on the wire and has no ratio
+    if (!input.empty()) {
+        this->stats_lock.lock();
+        this->compression_ratio = payload.size() / input.size();
+        this->stats_lock.unlock();
+    }
 
     Header h;
     h.payload_length = payload.size();
     h.code = static_cast<uint16_t>(Status_Code::OK);
-    h.set_net_order();
 
-    Network_Order_Message net_msg(h);
-    net_msg.payload = payload;
-    this->respond(job.clientfd.get(), net_msg);
+    Message msg(h);
+    msg.payload = std::move(payload);
+    this->reply(job, msg);
 
 }
 
-void Service::process_requests() {
+void Service::process_requests(Worker_Group* group) {
+
+    this->pin_to(*group);
 
     IF_VERBOSE (
-        printf("Worker started\n");
+        printf("Worker started on node %i\n", group->node.id);
     )
 
     while (true) {
 
-        std::unique_lock<std::mutex> lock(this->requests_lock);
-        this->waiting_workers.wait(lock, [this](){ return this->requests.size(); });
+        std::unique_lock<std::mutex> lock(group->requests_lock);
+        group->waiting_workers.wait(lock, [group](){ return group->requests.size() || group->stopping; });
+
+        if (group->requests.empty()) {
+            // Stopping and the queue is drained
+            IF_VERBOSE (
+                printf("Worker stopped\n");
+            )
+            return;
+        }
 
-        Job job = std::move(this->requests.front());
-        this->requests.pop();
+        Job job = std::move(group->requests.front());
+        group->requests.pop();
         lock.unlock();
 
         IF_VERBOSE (
             printf("Worker recieved job for client %i\n", job.clientfd.get());
         )
 
-        assert(job.clientfd.get() != -1);
+        assert(job.clientfd.get() != -1 || job.slot != nullptr);
 
-        switch (static_cast<Request_Code>(job.msg.header.code))
+        switch (static_cast<Request_Code>(job.request.header.code))
         {
             case Request_Code::PING:
-                this->ping(job); break;
+                this->reply(job, Canned_Responses::OK.data(), Canned_Responses::OK.size()); break;
             case Request_Code::GET_STATS:
                 this->get_stats(job); break;
             case Request_Code::RESET_STATS: